@@ -0,0 +1,491 @@
+/*!
+ *  \file catalog.c
+ *  \brief Read-only access to files inside a tape archive
+ *
+ *  The catalog is built once and never modified afterwards. Entries
+ *  live in one array, their normalized paths in one string pool and
+ *  the path lookup is an open-addressing hash table of entry indices.
+ *  Directory entries are stored as index ranges into one array.
+ *
+ */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "sassert.h"
+#include "minutar.h"
+#include "util.h"
+#include "catalog.h"
+
+static const uint32_t CATALOG_NO_ENTRY = UINT32_MAX;
+static const uint32_t CATALOG_ROOT = 0;
+static const size_t CATALOG_MAX_SYMLINKS = 40;
+static const size_t CATALOG_INITIAL_ENTRIES = 1024;
+static const mode_t CATALOG_IMPLICIT_DIR_MODE = 0755;
+
+typedef struct catalog_entry_s {
+    uint64_t data_offset;   /* offset of the contents in the archive, or of the target in the path pool for symlinks */
+    uint64_t size;
+    int64_t mtime;
+    uint64_t path;          /* offset of the normalized path in the path pool */
+    uint32_t parent;
+    uint32_t children;      /* first index into the children array */
+    uint32_t nchildren;
+    uint32_t devmajor;
+    uint32_t devminor;
+    uint16_t mode;
+    uint8_t type;
+} catalog_entry_t;
+
+struct minutar_catalog_s {
+    int tarfd;
+    catalog_entry_t *entries;
+    size_t nentries;
+    size_t entries_cap;
+    char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+    uint32_t *slots;        /* hash table of entry indices */
+    size_t slots_mask;
+    uint32_t *children;
+};
+
+
+static uint32_t catalog_lookup(const minutar_catalog_t *catalog, const char *path, size_t len)
+{
+    size_t slot = path_hash(path, len) & catalog->slots_mask;
+
+    while (catalog->slots[slot] != CATALOG_NO_ENTRY) {
+        uint32_t index = catalog->slots[slot];
+        const char *candidate = &catalog->pool[catalog->entries[index].path];
+        if (0 == strncmp(candidate, path, len) && candidate[len] == '\0') {
+            return index;
+        }
+        slot = (slot + 1) & catalog->slots_mask;
+    }
+    return CATALOG_NO_ENTRY;
+}
+
+static void catalog_insert_slot(minutar_catalog_t *catalog, uint32_t index)
+{
+    const char *path = &catalog->pool[catalog->entries[index].path];
+    size_t slot = path_hash(path, strlen(path)) & catalog->slots_mask;
+
+    while (catalog->slots[slot] != CATALOG_NO_ENTRY) {
+        slot = (slot + 1) & catalog->slots_mask;
+    }
+    catalog->slots[slot] = index;
+}
+
+static bool catalog_grow(minutar_catalog_t *catalog, size_t pool_needed)
+{
+    if (catalog->nentries == catalog->entries_cap) {
+        size_t new_cap = catalog->entries_cap * 2;
+        RETURN_FALSE_IF(new_cap >= CATALOG_NO_ENTRY);
+        catalog_entry_t *new_entries = realloc(catalog->entries, new_cap * sizeof(catalog_entry_t));
+        RETURN_FALSE_IF(NULL == new_entries);
+        catalog->entries = new_entries;
+        catalog->entries_cap = new_cap;
+    }
+
+    if (catalog->pool_cap - catalog->pool_len < pool_needed) {
+        size_t new_cap = catalog->pool_cap * 2 + pool_needed;
+        char *new_pool = realloc(catalog->pool, new_cap);
+        RETURN_FALSE_IF(NULL == new_pool);
+        catalog->pool = new_pool;
+        catalog->pool_cap = new_cap;
+    }
+
+    /* keep the hash table at most half full */
+    if (catalog->nentries + 1 > (catalog->slots_mask + 1) / 2) {
+        size_t new_size = (catalog->slots_mask + 1) * 2;
+        uint32_t *new_slots = malloc(new_size * sizeof(uint32_t));
+        RETURN_FALSE_IF(NULL == new_slots);
+        memset(new_slots, 0xff, new_size * sizeof(uint32_t));
+
+        free(catalog->slots);
+        catalog->slots = new_slots;
+        catalog->slots_mask = new_size - 1;
+
+        uint32_t i;
+        for (i = 0; i < catalog->nentries; ++i) {
+            catalog_insert_slot(catalog, i);
+        }
+    }
+
+    return true;
+}
+
+static uint64_t catalog_pool_add(minutar_catalog_t *catalog, const char *string, size_t len)
+{
+    SASSERT(catalog->pool_cap - catalog->pool_len >= len + 1);
+
+    uint64_t offset = catalog->pool_len;
+    memcpy(&catalog->pool[offset], string, len);
+    catalog->pool[offset + len] = '\0';
+    catalog->pool_len += len + 1;
+    return offset;
+}
+
+/* finds or adds the entry of a normalized path, adding implied parent directories */
+static bool catalog_add(minutar_catalog_t *catalog, const char *path, size_t len, uint32_t *output_index)
+{
+    uint32_t index = catalog_lookup(catalog, path, len);
+    if (index != CATALOG_NO_ENTRY) {
+        *output_index = index;
+        return true;
+    }
+
+    uint32_t parent = CATALOG_ROOT;
+    const char *separator = memrchr(path, '/', len);
+    if (NULL != separator) {
+        RETURN_FALSE_IF(!catalog_add(catalog, path, separator - path, &parent));
+    }
+
+    RETURN_FALSE_IF(!catalog_grow(catalog, len + 1));
+
+    index = catalog->nentries++;
+    catalog_entry_t *entry = &catalog->entries[index];
+    memset(entry, 0, sizeof(*entry));
+    entry->path = catalog_pool_add(catalog, path, len);
+    entry->parent = parent;
+    entry->type = TYPEFLAG_DIR;
+    entry->mode = CATALOG_IMPLICIT_DIR_MODE;
+    catalog_insert_slot(catalog, index);
+
+    *output_index = index;
+    return true;
+}
+
+static bool catalog_add_file(minutar_catalog_t *catalog, const filedesc_t *file, uint64_t data_offset)
+{
+    SASSERT(file->name != NULL);
+
+    char *path = NULL;
+    char *linktarget = NULL;
+    uint32_t index;
+
+    RETURN_FALSE_IF(!path_normalize((NULL != file->prefix) ? file->prefix : "", file->name, &path)); /* need cleanup after this line */
+    GOTO_CLEANUP_IF(!catalog_add(catalog, path, strlen(path), &index));
+
+    catalog_entry_t entry = catalog->entries[index];
+    entry.type = file->type;
+    entry.mode = file->mode;
+    entry.mtime = file->mtime;
+    entry.size = file->size;
+    entry.devmajor = file->devmajor;
+    entry.devminor = file->devminor;
+    entry.data_offset = data_offset;
+
+    if (TYPEFLAG_SYM == file->type) {
+        GOTO_CLEANUP_IF(NULL == file->linktarget);
+        size_t target_len = strlen(file->linktarget);
+        GOTO_CLEANUP_IF(!catalog_grow(catalog, target_len + 1));
+        entry.data_offset = catalog_pool_add(catalog, file->linktarget, target_len);
+        entry.size = target_len;
+
+    } else if (TYPEFLAG_LNK == file->type) {
+        /* a hardlink is the same file node as its target, which comes earlier in the archive */
+        GOTO_CLEANUP_IF(NULL == file->linktarget);
+        GOTO_CLEANUP_IF(!path_normalize("", file->linktarget, &linktarget));
+        uint32_t target = catalog_lookup(catalog, linktarget, strlen(linktarget));
+        GOTO_CLEANUP_IF(CATALOG_NO_ENTRY == target || TYPEFLAG_DIR == catalog->entries[target].type);
+
+        const catalog_entry_t *target_entry = &catalog->entries[target];
+        entry.type = target_entry->type;
+        entry.mode = target_entry->mode;
+        entry.mtime = target_entry->mtime;
+        entry.size = target_entry->size;
+        entry.devmajor = target_entry->devmajor;
+        entry.devminor = target_entry->devminor;
+        entry.data_offset = target_entry->data_offset;
+
+    } else if (TYPEFLAG_CONT == file->type) {
+        entry.type = TYPEFLAG_REG;
+    }
+
+    if (CATALOG_ROOT == index) {
+        /* "./" may describe the root, but it can't become anything else */
+        GOTO_CLEANUP_IF(TYPEFLAG_DIR != entry.type);
+    }
+    catalog->entries[index] = entry;
+
+    free(linktarget);
+    free(path);
+    return true;
+
+  cleanup:
+    free(linktarget);
+    free(path);
+    return false;
+}
+
+static bool catalog_scan(minutar_catalog_t *catalog, FILE *tarfile)
+{
+    filedesc_t file;
+
+    while (minutar_get_next_file(tarfile, &file)) {
+        if (TYPEFLAG_EOA == file.type) {
+            return true;
+        }
+
+        long data_offset = ftell(tarfile);
+        bool ok = (data_offset >= 0) &&
+                  catalog_add_file(catalog, &file, data_offset) &&
+                  minutar_skip_file(tarfile, file);
+        minutar_free_filedesc(&file);
+        RETURN_FALSE_IF(!ok);
+    }
+
+    return false;
+}
+
+/* lays out the entries of each directory as a range of the children array */
+static bool catalog_link_children(minutar_catalog_t *catalog)
+{
+    catalog->children = malloc(catalog->nentries * sizeof(uint32_t));
+    RETURN_FALSE_IF(NULL == catalog->children);
+
+    uint32_t i;
+    for (i = 1; i < catalog->nentries; ++i) {
+        catalog->entries[catalog->entries[i].parent].nchildren++;
+    }
+
+    uint32_t next = 0;
+    for (i = 0; i < catalog->nentries; ++i) {
+        catalog->entries[i].children = next;
+        next += catalog->entries[i].nchildren;
+        catalog->entries[i].nchildren = 0;
+    }
+
+    for (i = 1; i < catalog->nentries; ++i) {
+        catalog_entry_t *parent = &catalog->entries[catalog->entries[i].parent];
+        catalog->children[parent->children + parent->nchildren++] = i;
+    }
+
+    return true;
+}
+
+/* looks up a path, following symlinks in all its elements; the last one only if "follow" is set */
+static bool catalog_resolve(const minutar_catalog_t *catalog, const char *path, bool follow, size_t depth, uint32_t *output_index)
+{
+    SASSERT(path != NULL);
+    SASSERT(output_index != NULL);
+
+    if (depth > CATALOG_MAX_SYMLINKS) {
+        errno = ELOOP;
+        return false;
+    }
+
+    char *normalized = NULL;
+    char *base = NULL;
+    char *target = NULL;
+    bool ok = false;
+
+    RETURN_FALSE_IF(!path_normalize("", path, &normalized)); /* need cleanup after this line */
+    size_t len = strlen(normalized);
+
+    /* find the first element that is a symlink, if any */
+    size_t element_end = 0;
+    uint32_t index = CATALOG_ROOT;
+    while (element_end < len) {
+        const char *element = (0 == element_end) ? normalized : &normalized[element_end + 1];
+        element_end = strchrnul(element, '/') - normalized;
+
+        index = catalog_lookup(catalog, normalized, element_end);
+        if (CATALOG_NO_ENTRY == index) {
+            errno = ENOENT;
+            goto cleanup;
+        }
+
+        const catalog_entry_t *entry = &catalog->entries[index];
+        if (TYPEFLAG_SYM == entry->type && (element_end < len || follow)) {
+            /* restart from the link target, relative to the directory of the symlink */
+            const char *parent = &catalog->pool[catalog->entries[entry->parent].path];
+            GOTO_CLEANUP_IF(!path_normalize(parent, &catalog->pool[entry->data_offset], &base));
+            GOTO_CLEANUP_IF(!path_normalize(base, (element_end < len) ? &normalized[element_end + 1] : "", &target));
+            ok = catalog_resolve(catalog, target, follow, depth + 1, &index);
+            goto cleanup;
+        }
+        if (element_end < len && TYPEFLAG_DIR != entry->type) {
+            errno = ENOTDIR;
+            goto cleanup;
+        }
+    }
+
+    ok = true;
+
+  cleanup:
+    if (ok) {
+        *output_index = index;
+    }
+    free(target);
+    free(base);
+    free(normalized);
+    return ok;
+}
+
+/********************************* PUBLIC FUNCTIONS *********************************************/
+
+minutar_catalog_t *minutar_catalog_open(int tarfd)
+{
+    SASSERT(tarfd >= 0);
+
+    FILE *tarfile = NULL;
+    int scanfd = -1;
+    uint32_t root;
+
+    /* scan through a duplicate, its offset is shared so restore it afterwards */
+    off_t fpos = lseek(tarfd, 0, SEEK_CUR);
+    if (fpos < 0) {
+        return NULL;
+    }
+
+    minutar_catalog_t *catalog = calloc(1, sizeof(*catalog));
+    if (NULL == catalog) {
+        return NULL;
+    }
+    catalog->tarfd = tarfd;
+    catalog->entries_cap = CATALOG_INITIAL_ENTRIES;
+    catalog->entries = malloc(catalog->entries_cap * sizeof(catalog_entry_t));
+    GOTO_CLEANUP_IF(NULL == catalog->entries);
+    catalog->slots = malloc(2 * CATALOG_INITIAL_ENTRIES * sizeof(uint32_t));
+    GOTO_CLEANUP_IF(NULL == catalog->slots);
+    memset(catalog->slots, 0xff, 2 * CATALOG_INITIAL_ENTRIES * sizeof(uint32_t));
+    catalog->slots_mask = 2 * CATALOG_INITIAL_ENTRIES - 1;
+    GOTO_CLEANUP_IF(!catalog_add(catalog, "", 0, &root));
+    SASSERT(CATALOG_ROOT == root);
+
+    GOTO_CLEANUP_IF(lseek(tarfd, 0, SEEK_SET) != 0);
+    scanfd = dup(tarfd);
+    GOTO_CLEANUP_IF(scanfd < 0);
+    tarfile = fdopen(scanfd, "rb");
+    GOTO_CLEANUP_IF(NULL == tarfile);
+    scanfd = -1; /* owned by tarfile now */
+
+    GOTO_CLEANUP_IF(!catalog_scan(catalog, tarfile));
+    GOTO_CLEANUP_IF(!catalog_link_children(catalog));
+
+    fclose(tarfile);
+    GOTO_CLEANUP_IF(lseek(tarfd, fpos, SEEK_SET) != fpos);
+    return catalog;
+
+  cleanup:
+    if (NULL != tarfile) {
+        fclose(tarfile);
+    }
+    if (scanfd >= 0) {
+        close(scanfd);
+    }
+    lseek(tarfd, fpos, SEEK_SET);
+    minutar_catalog_free(catalog);
+    return NULL;
+}
+
+void minutar_catalog_free(minutar_catalog_t *catalog)
+{
+    SASSERT(catalog != NULL);
+
+    free(catalog->entries);
+    free(catalog->pool);
+    free(catalog->slots);
+    free(catalog->children);
+    free(catalog);
+}
+
+bool minutar_stat(const minutar_catalog_t *catalog, const char *path, minutar_stat_t *output_stat)
+{
+    SASSERT(catalog != NULL);
+    SASSERT(output_stat != NULL);
+
+    uint32_t index;
+    RETURN_FALSE_IF(!catalog_resolve(catalog, path, true, 0, &index));
+
+    const catalog_entry_t *entry = &catalog->entries[index];
+    memset(output_stat, 0, sizeof(*output_stat));
+    output_stat->type = entry->type;
+    output_stat->size = entry->size;
+    output_stat->mode = entry->mode;
+    output_stat->mtime = entry->mtime;
+    output_stat->devmajor = entry->devmajor;
+    output_stat->devminor = entry->devminor;
+    output_stat->nentries = entry->nchildren;
+    return true;
+}
+
+bool minutar_readdir(const minutar_catalog_t *catalog, const char *path, size_t index, const char **output_name)
+{
+    SASSERT(catalog != NULL);
+    SASSERT(output_name != NULL);
+
+    uint32_t dir;
+    RETURN_FALSE_IF(!catalog_resolve(catalog, path, true, 0, &dir));
+
+    const catalog_entry_t *entry = &catalog->entries[dir];
+    if (TYPEFLAG_DIR != entry->type) {
+        errno = ENOTDIR;
+        return false;
+    }
+    if (index >= entry->nchildren) {
+        errno = ENOENT;
+        return false;
+    }
+
+    const char *child_path = &catalog->pool[catalog->entries[catalog->children[entry->children + index]].path];
+    const char *separator = strrchr(child_path, '/');
+    *output_name = (NULL != separator) ? separator + 1 : child_path;
+    return true;
+}
+
+bool minutar_pread(const minutar_catalog_t *catalog, const char *path, size_t offset, size_t len, void *output_buf, size_t *output_len)
+{
+    SASSERT(catalog != NULL);
+    SASSERT(output_buf != NULL || len == 0);
+    SASSERT(output_len != NULL);
+
+    uint32_t index;
+    RETURN_FALSE_IF(!catalog_resolve(catalog, path, true, 0, &index));
+
+    const catalog_entry_t *entry = &catalog->entries[index];
+    if (TYPEFLAG_DIR == entry->type) {
+        errno = EISDIR;
+        return false;
+    }
+    if (TYPEFLAG_REG != entry->type) {
+        errno = EINVAL;
+        return false;
+    }
+
+    if (offset >= entry->size) {
+        len = 0;
+    } else if (len > entry->size - offset) {
+        len = entry->size - offset;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = pread(catalog->tarfd, (uint8_t *)output_buf + done, len - done, entry->data_offset + offset + done);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        RETURN_FALSE_IF(got < 0);
+        if (0 == got) {
+            /* archive is shorter than its headers claim */
+            errno = EIO;
+            return false;
+        }
+        done += got;
+    }
+
+    *output_len = done;
+    return true;
+}
@@ -0,0 +1,110 @@
+/*!
+ *  \file catalog.h
+ *  \brief Interface for read-only access to files inside a tape archive
+ *
+ */
+#ifndef MINUTAR_CATALOG_H_INCLUDED
+#define MINUTAR_CATALOG_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "minutar.h"
+
+/*!
+ * \struct minutar_catalog_t
+ * \brief Opaque in-memory index of all file nodes in a tape archive
+ *
+ * A catalog is immutable once opened, so any number of threads
+ * may query it concurrently without locking.
+ *
+ */
+typedef struct minutar_catalog_s minutar_catalog_t;
+
+/*!
+ * \struct minutar_stat_t
+ * \brief Datastructure that describes a file node in a catalog
+ *
+ * Hardlinks and symbolic links are resolved, so "type"
+ * is never TYPEFLAG_LNK or TYPEFLAG_SYM.
+ *
+ */
+typedef struct minutar_stat_s {
+    typeflag_t type;        /*! the type of the file node */
+    size_t size;            /*! the size of the contents of the file node */
+    size_t mode;            /*! bitfield of the file node access mode */
+    time_t mtime;           /*! the unix epoch-time representation of the file node modification time */
+    size_t devmajor;        /*! the major type of a block/character device node */
+    size_t devminor;        /*! the minor type of a block/character device node */
+    size_t nentries;        /*! the number of entries of a directory, for minutar_readdir() */
+} minutar_stat_t;
+
+/*!
+ *  \fn minutar_catalog_t *minutar_catalog_open(int tarfd)
+ *  \brief Scans an uncompressed tape archive into a catalog
+ *
+ *  Reads all headers of the archive from the start, without
+ *  changing the file offset of "tarfd". Directories that are
+ *  only implied by the paths of other file nodes are added.
+ *  When a path occurs more than once, the last one wins.
+ *
+ *  The caller must keep "tarfd" open while the catalog is used,
+ *  file contents are read from it with pread().
+ *
+ *  Returns NULL on failure, caller should check errno.
+ *  The caller must call minutar_catalog_free() on the result.
+ *
+ */
+minutar_catalog_t *minutar_catalog_open(int tarfd);
+
+/*!
+ *  \fn void minutar_catalog_free(minutar_catalog_t *catalog)
+ *  \brief Frees a catalog returned by minutar_catalog_open
+ *
+ */
+void minutar_catalog_free(minutar_catalog_t *catalog);
+
+/*!
+ *  \fn bool minutar_stat(const minutar_catalog_t *catalog, const char *path, minutar_stat_t *output_stat)
+ *  \brief Gets the description of a file node in a catalog
+ *
+ *  Paths are relative to the root of the archive, a leading
+ *  slash and "." elements are ignored, ".." elements are
+ *  applied to the path before symbolic links are followed
+ *  in every path element.
+ *
+ *  Returns false if the path could not be resolved, caller
+ *  should check errno.
+ *
+ */
+bool minutar_stat(const minutar_catalog_t *catalog, const char *path, minutar_stat_t *output_stat);
+
+/*!
+ *  \fn bool minutar_readdir(const minutar_catalog_t *catalog, const char *path, size_t index, const char **output_name)
+ *  \brief Gets the name of an entry of a directory in a catalog
+ *
+ *  Entries are numbered from zero up to the "nentries" field
+ *  output by minutar_stat(), in archive order. The output name
+ *  is owned by the catalog and stays valid until it is freed.
+ *
+ *  Returns false if the path is not a directory or "index" is
+ *  out of range, caller should check errno.
+ *
+ */
+bool minutar_readdir(const minutar_catalog_t *catalog, const char *path, size_t index, const char **output_name);
+
+/*!
+ *  \fn bool minutar_pread(const minutar_catalog_t *catalog, const char *path, size_t offset, size_t len, void *output_buf, size_t *output_len)
+ *  \brief Reads the contents of a file in a catalog
+ *
+ *  Reads up to "len" bytes starting at "offset" within the file
+ *  straight from the archive. The number of bytes read is output,
+ *  it is only less than "len" at the end of the file.
+ *
+ *  Returns false on failure, caller should check errno.
+ *
+ */
+bool minutar_pread(const minutar_catalog_t *catalog, const char *path, size_t offset, size_t len, void *output_buf, size_t *output_len);
+
+#endif /* MINUTAR_CATALOG_H_INCLUDED */
@@ -0,0 +1,877 @@
+/*!
+ *  \file decompress.c
+ *  \brief Parallel decompression of compressed tape archives
+ *
+ *  A splitter thread cuts the compressed input into chunks at
+ *  gzip member or zstd frame boundaries, a pool of worker threads
+ *  decompresses the chunks and the reader consumes the results in
+ *  order through a stdio stream.
+ *
+ *  gzip members can only be found by looking for their header, which
+ *  may also appear by chance inside compressed data. A chunk that does
+ *  not end on a member boundary (false header or an oversized member
+ *  that had to be cut) is finished by the reader, which continues the
+ *  decompression serially into the following chunks until it reaches
+ *  a member boundary again.
+ *
+ */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <zlib.h>
+#include <zstd.h>
+
+#include "sassert.h"
+#include "util.h"
+#include "decompress.h"
+
+#define DECOMPRESS_HISTORY_SIZE  (64*1024)
+#define DECOMPRESS_IOBUF_SIZE    (16*1024)
+
+static const size_t DECOMPRESS_CHUNK_TARGET = 1024*1024;        /* cut at the first boundary after this much input */
+static const size_t DECOMPRESS_CHUNK_MAX = 8*1024*1024;         /* cut inside a member if no boundary was found */
+static const size_t DECOMPRESS_OUTPUT_MAX = 32*1024*1024;       /* leave the rest of a chunk to the reader beyond this */
+static const size_t DECOMPRESS_READ_SIZE = 256*1024;
+static const size_t DECOMPRESS_JOBS_PER_THREAD = 2;
+static const size_t GZIP_HEADER_SIZE = 10;
+static const uint32_t ZSTD_SKIPPABLE_MAGIC_MASK = 0xFFFFFFF0;
+static const uint32_t ZSTD_SKIPPABLE_MAGIC_VALUE = 0x184D2A50;
+
+
+typedef struct decoder_s {
+    compression_t compression;
+    z_stream zstream;
+    ZSTD_DStream *zstd;
+    bool at_boundary;       /* no member is partially decoded */
+} decoder_t;
+
+typedef enum {
+    JOB_FREE = 0,
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE
+} job_state_t;
+
+typedef enum {
+    JOB_COMPLETE,           /* all input decoded, ending on a member boundary */
+    JOB_PARTIAL,            /* the reader has to finish decoding the input */
+    JOB_FAILED
+} job_result_t;
+
+typedef struct job_s {
+    job_state_t state;
+    job_result_t result;
+    bool starts_member;     /* the splitter believes the input starts with a member header */
+    uint8_t *input;
+    size_t input_len;
+    size_t input_pos;
+    uint8_t *output;
+    size_t output_len;
+    size_t output_cap;
+    decoder_t *decoder;     /* decoder of a JOB_PARTIAL job, handed over to the reader */
+} job_t;
+
+typedef enum {
+    ZSTD_WALK_FRAME,
+    ZSTD_WALK_BLOCK,
+    ZSTD_WALK_INVALID
+} zstd_walk_t;
+
+typedef struct decompressor_s {
+    FILE *compressed;
+    compression_t compression;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t splitter;
+    bool splitter_started;
+    pthread_t *workers;
+    size_t nworkers;
+    job_t *jobs;
+    size_t njobs;
+    uint64_t next_fill;     /* sequence number of the next job from the splitter */
+    uint64_t next_run;      /* sequence number of the next job for a worker */
+    uint64_t next_serve;    /* sequence number of the job the reader is at */
+    bool input_done;
+    bool input_error;
+    bool shutdown;
+
+    /* splitter state, only touched by the splitter thread */
+    uint8_t *pending;
+    size_t pending_len;
+    size_t pending_cap;
+    size_t scan_pos;
+    bool pending_starts_member;
+    zstd_walk_t zstd_walk;
+    size_t zstd_checksum_len;
+
+    /* reader state, only touched by the reading thread */
+    job_t *current;
+    size_t output_pos;
+    decoder_t *serial_decoder;
+    size_t serial_pos;
+    uint8_t history[DECOMPRESS_HISTORY_SIZE];
+    uint64_t produced;
+    uint64_t position;
+} decompressor_t;
+
+
+/********************************* DECODER *********************************************/
+
+static void decoder_destroy(decoder_t *decoder)
+{
+    if (NULL == decoder) {
+        return;
+    }
+
+    switch (decoder->compression)
+    {
+    case COMPRESSION_GZIP:
+        inflateEnd(&decoder->zstream);
+        break;
+
+    case COMPRESSION_ZSTD:
+        ZSTD_freeDStream(decoder->zstd);
+        break;
+
+    default:
+        SUNREACHABLE();
+    }
+    free(decoder);
+}
+
+static decoder_t *decoder_create(compression_t compression)
+{
+    decoder_t *decoder = calloc(1, sizeof(*decoder));
+    if (NULL == decoder) {
+        return NULL;
+    }
+    decoder->compression = compression;
+    decoder->at_boundary = true;
+
+    switch (compression)
+    {
+    case COMPRESSION_GZIP:
+        /* 16 + MAX_WBITS accepts only gzip and verifies the crc and size trailer */
+        GOTO_CLEANUP_IF(inflateInit2(&decoder->zstream, 16 + MAX_WBITS) != Z_OK);
+        break;
+
+    case COMPRESSION_ZSTD:
+        decoder->zstd = ZSTD_createDStream();
+        GOTO_CLEANUP_IF(NULL == decoder->zstd);
+        GOTO_CLEANUP_IF(ZSTD_isError(ZSTD_initDStream(decoder->zstd)));
+        break;
+
+    default:
+        SUNREACHABLE();
+    }
+    return decoder;
+
+  cleanup:
+    decoder_destroy(decoder);
+    return NULL;
+}
+
+/* decodes as much as fits, stopping after each member; returns false on corrupt data */
+static bool decoder_run(decoder_t *decoder, const uint8_t *input, size_t input_len, size_t *input_pos,
+                        uint8_t *output, size_t output_len, size_t *output_pos)
+{
+    SASSERT(decoder != NULL);
+    SASSERT(*input_pos <= input_len);
+    SASSERT(*output_pos <= output_len);
+
+    size_t input_before = *input_pos;
+    size_t output_before = *output_pos;
+    bool member_end = false;
+
+    switch (decoder->compression)
+    {
+    case COMPRESSION_GZIP:
+    {
+        z_stream *zs = &decoder->zstream;
+        zs->next_in = (Bytef *)&input[*input_pos];
+        zs->avail_in = (uInt)(input_len - *input_pos);
+        zs->next_out = &output[*output_pos];
+        zs->avail_out = (uInt)(output_len - *output_pos);
+
+        int ret = inflate(zs, Z_NO_FLUSH);
+        *input_pos = input_len - zs->avail_in;
+        *output_pos = output_len - zs->avail_out;
+
+        if (Z_STREAM_END == ret) {
+            member_end = true;
+            RETURN_FALSE_IF(inflateReset(zs) != Z_OK);
+        } else {
+            /* Z_BUF_ERROR only means that no progress was possible */
+            RETURN_FALSE_IF(ret != Z_OK && ret != Z_BUF_ERROR);
+        }
+        break;
+    }
+
+    case COMPRESSION_ZSTD:
+    {
+        ZSTD_inBuffer in = { input, input_len, *input_pos };
+        ZSTD_outBuffer out = { output, output_len, *output_pos };
+
+        size_t ret = ZSTD_decompressStream(decoder->zstd, &out, &in);
+        RETURN_FALSE_IF(ZSTD_isError(ret));
+        *input_pos = in.pos;
+        *output_pos = out.pos;
+
+        /* zero means a frame was completely decoded and flushed */
+        member_end = (0 == ret);
+        break;
+    }
+
+    default:
+        SUNREACHABLE();
+    }
+
+    if (member_end) {
+        decoder->at_boundary = true;
+    } else if (*input_pos != input_before || *output_pos != output_before) {
+        decoder->at_boundary = false;
+    }
+    return true;
+}
+
+
+/********************************* SPLITTER *********************************************/
+
+static uint32_t read_le32(const uint8_t *data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static bool gzip_header_candidate(const uint8_t *data)
+{
+    /* magic, deflate method, no reserved flags, known XFL and OS values */
+    return (data[0] == 0x1f && data[1] == 0x8b && data[2] == 0x08 &&
+            (data[3] & 0xe0) == 0 &&
+            (data[8] == 0 || data[8] == 2 || data[8] == 4) &&
+            (data[9] <= 13 || data[9] == 255));
+}
+
+/* returns the first member header at or after DECOMPRESS_CHUNK_TARGET, zero if none found yet */
+static size_t gzip_find_cut(decompressor_t *d)
+{
+    if (d->pending_len < GZIP_HEADER_SIZE) {
+        return 0;
+    }
+    size_t limit = d->pending_len - GZIP_HEADER_SIZE + 1;
+
+    if (d->scan_pos < DECOMPRESS_CHUNK_TARGET) {
+        d->scan_pos = DECOMPRESS_CHUNK_TARGET;
+    }
+
+    while (d->scan_pos < limit) {
+        const uint8_t *found = memchr(&d->pending[d->scan_pos], 0x1f, limit - d->scan_pos);
+        if (NULL == found) {
+            d->scan_pos = limit;
+            break;
+        }
+        d->scan_pos = found - d->pending;
+        if (gzip_header_candidate(found)) {
+            return d->scan_pos;
+        }
+        d->scan_pos++;
+    }
+
+    return 0;
+}
+
+/* walks zstd frame and block headers, returns the first frame end at or after DECOMPRESS_CHUNK_TARGET, zero if none found yet */
+static size_t zstd_find_cut(decompressor_t *d)
+{
+    static const size_t dictid_len[4] = { 0, 1, 2, 4 };
+
+    while (d->zstd_walk != ZSTD_WALK_INVALID && d->scan_pos < d->pending_len) {
+        const uint8_t *data = &d->pending[d->scan_pos];
+        size_t avail = d->pending_len - d->scan_pos;
+
+        if (ZSTD_WALK_FRAME == d->zstd_walk) {
+            if (avail < 5) {
+                break;
+            }
+            uint32_t magic = read_le32(data);
+            if ((magic & ZSTD_SKIPPABLE_MAGIC_MASK) == ZSTD_SKIPPABLE_MAGIC_VALUE) {
+                if (avail < 8) {
+                    break;
+                }
+                d->scan_pos += 8 + (size_t)read_le32(&data[4]);
+
+            } else if (magic == ZSTD_MAGICNUMBER) {
+                /* frame header descriptor: content size, single segment, checksum and dictionary id flags */
+                uint8_t descriptor = data[4];
+                bool single_segment = descriptor & 0x20;
+                size_t fcs_len = (0 == (descriptor >> 6)) ? (single_segment ? 1 : 0) : ((size_t)1 << (descriptor >> 6));
+
+                d->zstd_checksum_len = (descriptor & 0x04) ? 4 : 0;
+                d->zstd_walk = ZSTD_WALK_BLOCK;
+                d->scan_pos += 5 + (single_segment ? 0 : 1) + dictid_len[descriptor & 0x03] + fcs_len;
+                continue;
+
+            } else {
+                /* not a frame, leave it to the decoder to report */
+                d->zstd_walk = ZSTD_WALK_INVALID;
+                break;
+            }
+
+        } else /* ZSTD_WALK_BLOCK */ {
+            if (avail < 3) {
+                break;
+            }
+            uint32_t block_header = (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16);
+            bool last_block = block_header & 1;
+            uint32_t block_type = (block_header >> 1) & 3;
+            size_t block_size = block_header >> 3;
+
+            if (3 == block_type) {
+                d->zstd_walk = ZSTD_WALK_INVALID;
+                break;
+            }
+            /* RLE blocks store a single byte */
+            d->scan_pos += 3 + ((1 == block_type) ? 1 : block_size);
+            if (!last_block) {
+                continue;
+            }
+            d->scan_pos += d->zstd_checksum_len;
+            d->zstd_walk = ZSTD_WALK_FRAME;
+        }
+
+        /* reached the end of a frame */
+        if (d->scan_pos >= DECOMPRESS_CHUNK_TARGET && d->scan_pos <= d->pending_len) {
+            return d->scan_pos;
+        }
+    }
+
+    return 0;
+}
+
+static bool splitter_fill(decompressor_t *d, bool *eof)
+{
+    if (d->pending_cap - d->pending_len < DECOMPRESS_READ_SIZE) {
+        size_t new_cap = d->pending_cap * 2 + DECOMPRESS_READ_SIZE;
+        uint8_t *new_pending = realloc(d->pending, new_cap);
+        RETURN_FALSE_IF(NULL == new_pending);
+        d->pending = new_pending;
+        d->pending_cap = new_cap;
+    }
+
+    size_t got = fread(&d->pending[d->pending_len], 1, DECOMPRESS_READ_SIZE, d->compressed);
+    d->pending_len += got;
+    if (got < DECOMPRESS_READ_SIZE) {
+        RETURN_FALSE_IF(ferror(d->compressed));
+        *eof = true;
+    }
+    return true;
+}
+
+static bool splitter_emit(decompressor_t *d, size_t cut, bool next_starts_member)
+{
+    SASSERT(cut > 0 && cut <= d->pending_len);
+
+    uint8_t *input = malloc(cut);
+    RETURN_FALSE_IF(NULL == input);
+    memcpy(input, d->pending, cut);
+    memmove(d->pending, &d->pending[cut], d->pending_len - cut);
+    d->pending_len -= cut;
+    d->scan_pos = (d->scan_pos > cut) ? d->scan_pos - cut : 0;
+
+    /* wait for a free slot, this is what stalls everything when the reader falls behind */
+    pthread_mutex_lock(&d->lock);
+    job_t *job = &d->jobs[d->next_fill % d->njobs];
+    while (!d->shutdown && job->state != JOB_FREE) {
+        pthread_cond_wait(&d->changed, &d->lock);
+    }
+    if (d->shutdown) {
+        pthread_mutex_unlock(&d->lock);
+        free(input);
+        return false;
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->state = JOB_QUEUED;
+    job->starts_member = d->pending_starts_member;
+    job->input = input;
+    job->input_len = cut;
+    d->next_fill++;
+    pthread_cond_broadcast(&d->changed);
+    pthread_mutex_unlock(&d->lock);
+
+    d->pending_starts_member = next_starts_member;
+    return true;
+}
+
+static void *splitter_main(void *arg)
+{
+    decompressor_t *d = arg;
+    bool eof = false;
+    bool ok = true;
+
+    while (ok) {
+        size_t cut = 0;
+        bool next_starts_member = true;
+
+        if (COMPRESSION_GZIP == d->compression) {
+            cut = gzip_find_cut(d);
+        } else {
+            cut = zstd_find_cut(d);
+        }
+
+        if (0 == cut && d->pending_len >= DECOMPRESS_CHUNK_MAX) {
+            /* oversized member, the reader will continue it across the cut */
+            cut = DECOMPRESS_CHUNK_MAX;
+            next_starts_member = false;
+        }
+        if (0 == cut && eof) {
+            if (0 == d->pending_len) {
+                break;
+            }
+            cut = d->pending_len;
+        }
+
+        if (0 == cut) {
+            ok = splitter_fill(d, &eof);
+        } else {
+            ok = splitter_emit(d, cut, next_starts_member);
+        }
+    }
+
+    pthread_mutex_lock(&d->lock);
+    d->input_done = true;
+    d->input_error = !ok;
+    pthread_cond_broadcast(&d->changed);
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+
+/********************************* WORKERS *********************************************/
+
+static job_result_t job_run(decompressor_t *d, job_t *job)
+{
+    if (!job->starts_member) {
+        /* continuation of a cut member, only the reader can decode it */
+        return JOB_PARTIAL;
+    }
+
+    decoder_t *decoder = decoder_create(d->compression);
+    if (NULL == decoder) {
+        return JOB_FAILED;
+    }
+
+    for (;;) {
+        if (job->output_len == job->output_cap) {
+            if (job->output_cap >= DECOMPRESS_OUTPUT_MAX) {
+                break;
+            }
+            size_t new_cap = job->output_cap ? job->output_cap * 2 : job->input_len * 4;
+            new_cap = (new_cap > DECOMPRESS_OUTPUT_MAX) ? DECOMPRESS_OUTPUT_MAX : new_cap;
+            uint8_t *new_output = realloc(job->output, new_cap);
+            if (NULL == new_output) {
+                decoder_destroy(decoder);
+                return JOB_FAILED;
+            }
+            job->output = new_output;
+            job->output_cap = new_cap;
+        }
+
+        size_t input_before = job->input_pos;
+        size_t output_before = job->output_len;
+
+        if (!decoder_run(decoder, job->input, job->input_len, &job->input_pos,
+                         job->output, job->output_cap, &job->output_len)) {
+            decoder_destroy(decoder);
+            return JOB_FAILED;
+        }
+
+        if (job->input_pos == job->input_len && decoder->at_boundary) {
+            decoder_destroy(decoder);
+            return JOB_COMPLETE;
+        }
+        if (job->input_pos == input_before && job->output_len == output_before) {
+            /* input ends inside a member */
+            break;
+        }
+    }
+
+    job->decoder = decoder;
+    return JOB_PARTIAL;
+}
+
+static void *worker_main(void *arg)
+{
+    decompressor_t *d = arg;
+
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        while (!d->shutdown && d->next_run == d->next_fill && !d->input_done) {
+            pthread_cond_wait(&d->changed, &d->lock);
+        }
+        if (d->shutdown || d->next_run == d->next_fill) {
+            break;
+        }
+
+        job_t *job = &d->jobs[d->next_run % d->njobs];
+        d->next_run++;
+        SASSERT(JOB_QUEUED == job->state);
+        job->state = JOB_RUNNING;
+        pthread_mutex_unlock(&d->lock);
+
+        job_result_t result = job_run(d, job);
+
+        pthread_mutex_lock(&d->lock);
+        job->result = result;
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&d->changed);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+
+/********************************* READER *********************************************/
+
+static void job_release(job_t *job)
+{
+    decoder_destroy(job->decoder);
+    free(job->input);
+    free(job->output);
+    memset(job, 0, sizeof(*job));
+}
+
+/* waits for the job the reader is at, returns false at the end of input */
+static bool reader_wait_job(decompressor_t *d, bool *failed)
+{
+    if (NULL != d->current) {
+        return true;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        job_t *job = &d->jobs[d->next_serve % d->njobs];
+        if (d->next_serve < d->next_fill && JOB_DONE == job->state) {
+            d->current = job;
+            d->output_pos = 0;
+            break;
+        }
+        if (d->next_serve == d->next_fill && d->input_done) {
+            *failed = d->input_error;
+            break;
+        }
+        pthread_cond_wait(&d->changed, &d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return (NULL != d->current);
+}
+
+static void reader_next_job(decompressor_t *d)
+{
+    SASSERT(d->current != NULL);
+
+    pthread_mutex_lock(&d->lock);
+    job_release(d->current);
+    d->current = NULL;
+    d->next_serve++;
+    pthread_cond_broadcast(&d->changed);
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* produces the next decompressed bytes, returns zero at the end and -1 on error */
+static ssize_t reader_produce(decompressor_t *d, uint8_t *buf, size_t size)
+{
+    for (;;) {
+        bool failed = false;
+        if (!reader_wait_job(d, &failed)) {
+            if (failed || (NULL != d->serial_decoder && !d->serial_decoder->at_boundary)) {
+                /* input error or truncated member */
+                errno = EIO;
+                return -1;
+            }
+            return 0;
+        }
+        job_t *job = d->current;
+
+        if (NULL == d->serial_decoder) {
+            if (JOB_FAILED == job->result) {
+                errno = EIO;
+                return -1;
+            }
+            if (d->output_pos < job->output_len) {
+                size_t len = job->output_len - d->output_pos;
+                len = (len > size) ? size : len;
+                memcpy(buf, &job->output[d->output_pos], len);
+                d->output_pos += len;
+                return len;
+            }
+            if (JOB_COMPLETE == job->result) {
+                reader_next_job(d);
+                continue;
+            }
+
+            /* the worker gave up inside a member, take over its decoder */
+            if (NULL == job->decoder) {
+                errno = EIO;
+                return -1;
+            }
+            d->serial_decoder = job->decoder;
+            d->serial_pos = job->input_pos;
+            job->decoder = NULL;
+        }
+
+        size_t input_before = d->serial_pos;
+        size_t len = 0;
+        if (!decoder_run(d->serial_decoder, job->input, job->input_len, &d->serial_pos, buf, size, &len)) {
+            errno = EIO;
+            return -1;
+        }
+        if (len > 0) {
+            return len;
+        }
+        if (d->serial_pos != input_before) {
+            continue;
+        }
+
+        /* the input of this job is used up, whatever the worker made of the next one is only valid on a member boundary */
+        reader_next_job(d);
+        if (d->serial_decoder->at_boundary && reader_wait_job(d, &failed) && d->current->starts_member) {
+            decoder_destroy(d->serial_decoder);
+            d->serial_decoder = NULL;
+        } else {
+            d->serial_pos = 0;
+        }
+    }
+}
+
+static void history_append(decompressor_t *d, const uint8_t *data, size_t len)
+{
+    d->produced += len;
+    d->position = d->produced;
+
+    if (len > DECOMPRESS_HISTORY_SIZE) {
+        data += len - DECOMPRESS_HISTORY_SIZE;
+        len = DECOMPRESS_HISTORY_SIZE;
+    }
+    size_t offset = (d->produced - len) % DECOMPRESS_HISTORY_SIZE;
+    size_t first = DECOMPRESS_HISTORY_SIZE - offset;
+    first = (first > len) ? len : first;
+
+    memcpy(&d->history[offset], data, first);
+    memcpy(d->history, &data[first], len - first);
+}
+
+static ssize_t decompress_cookie_read(void *cookie, char *buf, size_t size)
+{
+    decompressor_t *d = cookie;
+
+    if (d->position < d->produced) {
+        /* stdio seeks back over the data it has buffered, replay it */
+        size_t offset = d->position % DECOMPRESS_HISTORY_SIZE;
+        size_t len = d->produced - d->position;
+        len = (len > size) ? size : len;
+        len = (len > DECOMPRESS_HISTORY_SIZE - offset) ? DECOMPRESS_HISTORY_SIZE - offset : len;
+        memcpy(buf, &d->history[offset], len);
+        d->position += len;
+        return len;
+    }
+
+    ssize_t len = reader_produce(d, (uint8_t *)buf, size);
+    if (len > 0) {
+        history_append(d, (uint8_t *)buf, len);
+    }
+    return len;
+}
+
+static int decompress_cookie_seek(void *cookie, off64_t *offset, int whence)
+{
+    decompressor_t *d = cookie;
+    uint64_t target;
+
+    switch (whence)
+    {
+    case SEEK_SET:
+        target = 0;
+        break;
+    case SEEK_CUR:
+        target = d->position;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (*offset < 0 && (uint64_t)-*offset > target) {
+        errno = EINVAL;
+        return -1;
+    }
+    target += *offset;
+
+    if (target + DECOMPRESS_HISTORY_SIZE < d->produced) {
+        /* too far back, the data is gone */
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (target <= d->produced) {
+        d->position = target;
+    } else {
+        uint8_t discard[DECOMPRESS_IOBUF_SIZE];
+
+        d->position = d->produced;
+        while (d->produced < target) {
+            size_t want = (target - d->produced > sizeof(discard)) ? sizeof(discard) : target - d->produced;
+            ssize_t len = reader_produce(d, discard, want);
+            if (len <= 0) {
+                if (0 == len) {
+                    errno = EINVAL;
+                }
+                return -1;
+            }
+            history_append(d, discard, len);
+        }
+    }
+
+    *offset = d->position;
+    return 0;
+}
+
+static void decompressor_free(decompressor_t *d)
+{
+    pthread_mutex_lock(&d->lock);
+    d->shutdown = true;
+    pthread_cond_broadcast(&d->changed);
+    pthread_mutex_unlock(&d->lock);
+
+    if (d->splitter_started) {
+        pthread_join(d->splitter, NULL);
+    }
+    size_t i;
+    for (i = 0; i < d->nworkers; ++i) {
+        pthread_join(d->workers[i], NULL);
+    }
+
+    if (NULL != d->jobs) {
+        for (i = 0; i < d->njobs; ++i) {
+            job_release(&d->jobs[i]);
+        }
+    }
+    decoder_destroy(d->serial_decoder);
+
+    pthread_cond_destroy(&d->changed);
+    pthread_mutex_destroy(&d->lock);
+    free(d->pending);
+    free(d->workers);
+    free(d->jobs);
+    free(d);
+}
+
+static int decompress_cookie_close(void *cookie)
+{
+    decompressor_free(cookie);
+    return 0;
+}
+
+/********************************* PUBLIC FUNCTIONS *********************************************/
+
+compression_t decompress_detect(FILE *compressed)
+{
+    SASSERT(compressed != NULL);
+
+    uint8_t magic[4];
+
+    long fpos = ftell(compressed);
+    if (fpos < 0) {
+        return COMPRESSION_NONE;
+    }
+    size_t got = fread(magic, 1, sizeof(magic), compressed);
+    if (fseek(compressed, fpos, SEEK_SET) != 0) {
+        return COMPRESSION_NONE;
+    }
+
+    if (got >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return COMPRESSION_GZIP;
+    }
+    if (got == sizeof(magic)) {
+        uint32_t value = read_le32(magic);
+        if (value == ZSTD_MAGICNUMBER || (value & ZSTD_SKIPPABLE_MAGIC_MASK) == ZSTD_SKIPPABLE_MAGIC_VALUE) {
+            return COMPRESSION_ZSTD;
+        }
+    }
+    return COMPRESSION_NONE;
+}
+
+FILE *decompress_open(FILE *compressed, compression_t compression, size_t nthreads)
+{
+    SASSERT(compressed != NULL);
+    SASSERT(COMPRESSION_GZIP == compression || COMPRESSION_ZSTD == compression);
+
+    if (0 == nthreads) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (online > 0) ? (size_t)online : 1;
+    }
+
+    decompressor_t *d = calloc(1, sizeof(*d));
+    if (NULL == d) {
+        return NULL;
+    }
+    if (pthread_mutex_init(&d->lock, NULL) != 0) {
+        free(d);
+        return NULL;
+    }
+    if (pthread_cond_init(&d->changed, NULL) != 0) {
+        pthread_mutex_destroy(&d->lock);
+        free(d);
+        return NULL;
+    }
+    d->compressed = compressed;
+    d->compression = compression;
+    d->pending_starts_member = true;
+    d->zstd_walk = ZSTD_WALK_FRAME;
+
+    FILE *output = NULL;
+    cookie_io_functions_t io = {
+        .read = decompress_cookie_read,
+        .write = NULL,
+        .seek = decompress_cookie_seek,
+        .close = decompress_cookie_close
+    };
+
+    d->njobs = nthreads * DECOMPRESS_JOBS_PER_THREAD;
+    d->jobs = calloc(d->njobs, sizeof(job_t));
+    GOTO_CLEANUP_IF(NULL == d->jobs);
+    d->workers = calloc(nthreads, sizeof(pthread_t));
+    GOTO_CLEANUP_IF(NULL == d->workers);
+
+    GOTO_CLEANUP_IF(pthread_create(&d->splitter, NULL, splitter_main, d) != 0);
+    d->splitter_started = true;
+    while (d->nworkers < nthreads) {
+        GOTO_CLEANUP_IF(pthread_create(&d->workers[d->nworkers], NULL, worker_main, d) != 0);
+        d->nworkers++;
+    }
+
+    output = fopencookie(d, "r", io);
+    GOTO_CLEANUP_IF(NULL == output);
+
+    /* stdio may seek back over its whole buffer, which must fit in the history */
+    if (setvbuf(output, NULL, _IOFBF, DECOMPRESS_IOBUF_SIZE) != 0) {
+        fclose(output);
+        return NULL;
+    }
+    return output;
+
+  cleanup:
+    decompressor_free(d);
+    return NULL;
+}
@@ -0,0 +1,58 @@
+/*!
+ *  \file decompress.h
+ *  \brief Interface for parallel decompression of compressed tape archives
+ *
+ */
+#ifndef MINUTAR_DECOMPRESS_H_INCLUDED
+#define MINUTAR_DECOMPRESS_H_INCLUDED
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/*!
+ * \enum compression_t
+ * \brief Datastructure that indicates the compression format of an archive file
+ *
+ */
+typedef enum {
+    COMPRESSION_NONE = 0,   /*! plain tape archive, no decompression needed */
+    COMPRESSION_GZIP,       /*! gzip, possibly with multiple members (e.g. from pigz) */
+    COMPRESSION_ZSTD        /*! zstandard, possibly with multiple frames */
+} compression_t;
+
+/*!
+ *  \fn compression_t decompress_detect(FILE *compressed)
+ *  \brief Detects the compression format of an archive file
+ *
+ *  Looks at the magic number at the current read position
+ *  and restores the read position afterwards.
+ *
+ *  Returns COMPRESSION_NONE if the format is not recognized
+ *  or the file could not be read.
+ *
+ */
+compression_t decompress_detect(FILE *compressed);
+
+/*!
+ *  \fn FILE *decompress_open(FILE *compressed, compression_t compression, size_t nthreads)
+ *  \brief Opens a decompressed view of a compressed archive file
+ *
+ *  Independent gzip members or zstd frames are decompressed
+ *  on "nthreads" worker threads (the number of online CPUs
+ *  if zero) and reassembled in order. The amount of data in
+ *  flight is bounded, the workers are stalled when the reader
+ *  falls behind.
+ *
+ *  The returned stream is read-only, supports ftell() and
+ *  seeking forward, so it can be passed to minutar_extract_all()
+ *  and friends. Seeking backward is only supported within the
+ *  most recently read data.
+ *
+ *  Returns NULL on failure, caller should check errno.
+ *  The caller must fclose() the returned stream, which stops
+ *  the worker threads. The "compressed" file is not closed.
+ *
+ */
+FILE *decompress_open(FILE *compressed, compression_t compression, size_t nthreads);
+
+#endif /* MINUTAR_DECOMPRESS_H_INCLUDED */
@@ -0,0 +1,590 @@
+/*!
+ *  \file layers.c
+ *  \brief Extracting stacked container image layers
+ *
+ *  The layers are scanned from the top down, so the first layer that
+ *  has a path owns it, and whiteouts, opaque directories and
+ *  non-directories hide what lower layers have below them. Only the
+ *  owned file nodes are extracted afterwards: directories first, then
+ *  the files of each layer and at last the hardlinks.
+ *
+ *  A hardlink refers to the file node with the contents in its own
+ *  layer. When an upper layer replaced or deleted the path of that
+ *  file node, the first surviving hardlink to it is extracted from its
+ *  contents instead, and the other hardlinks link to that one.
+ *
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "sassert.h"
+#include "minutar.h"
+#include "util.h"
+#include "layers.h"
+
+static const char *WHITEOUT_PREFIX = ".wh.";
+static const char *WHITEOUT_OPAQUE = ".wh..wh..opq";
+static const uint32_t LAYERS_NO_NODE = UINT32_MAX;
+static const int LAYERS_NONE = -1;
+static const size_t LAYERS_INITIAL_SLOTS = 1024;
+static const size_t LAYERS_UNRESOLVED = SIZE_MAX;
+
+typedef struct layer_node_s {
+    char *path;             /* normalized path as a malloc()ed string */
+    char *linktarget;       /* normalized hardlink target as a malloc()ed string */
+    int owner;              /* the layer the path is extracted from */
+    size_t ordinal;         /* position of the owning file node in its layer */
+    size_t data_ordinal;    /* hardlinks: position of the file node with the contents, in the same layer */
+    bool promoted;          /* hardlink extracted from the contents, since its target didn't survive */
+    typeflag_t type;
+    size_t mode;
+    int deleted_by;         /* highest layer with a whiteout for the path */
+    int hidden_below_by;    /* highest layer that hides everything below the path */
+} layer_node_t;
+
+typedef struct layer_view_s {
+    layer_node_t *nodes;
+    size_t nnodes;
+    size_t nodes_cap;
+    uint32_t *slots;        /* hash table of node indices */
+    size_t slots_mask;
+} layer_view_t;
+
+
+static bool view_init(layer_view_t *view)
+{
+    memset(view, 0, sizeof(*view));
+    view->nodes_cap = LAYERS_INITIAL_SLOTS / 2;
+    view->nodes = malloc(view->nodes_cap * sizeof(layer_node_t));
+    RETURN_FALSE_IF(NULL == view->nodes);
+    view->slots = malloc(LAYERS_INITIAL_SLOTS * sizeof(uint32_t));
+    RETURN_FALSE_IF(NULL == view->slots);
+    memset(view->slots, 0xff, LAYERS_INITIAL_SLOTS * sizeof(uint32_t));
+    view->slots_mask = LAYERS_INITIAL_SLOTS - 1;
+    return true;
+}
+
+static uint32_t view_lookup(const layer_view_t *view, const char *path, size_t len)
+{
+    size_t slot = path_hash(path, len) & view->slots_mask;
+
+    while (view->slots[slot] != LAYERS_NO_NODE) {
+        const char *candidate = view->nodes[view->slots[slot]].path;
+        if (0 == strncmp(candidate, path, len) && candidate[len] == '\0') {
+            return view->slots[slot];
+        }
+        slot = (slot + 1) & view->slots_mask;
+    }
+    return LAYERS_NO_NODE;
+}
+
+static void view_insert_slot(layer_view_t *view, uint32_t index)
+{
+    const char *path = view->nodes[index].path;
+    size_t slot = path_hash(path, strlen(path)) & view->slots_mask;
+
+    while (view->slots[slot] != LAYERS_NO_NODE) {
+        slot = (slot + 1) & view->slots_mask;
+    }
+    view->slots[slot] = index;
+}
+
+/* finds or adds the node of a normalized path */
+static bool view_get(layer_view_t *view, const char *path, size_t len, layer_node_t **output_node)
+{
+    uint32_t index = view_lookup(view, path, len);
+    if (index != LAYERS_NO_NODE) {
+        *output_node = &view->nodes[index];
+        return true;
+    }
+
+    if (view->nnodes == view->nodes_cap) {
+        size_t new_cap = view->nodes_cap * 2;
+        RETURN_FALSE_IF(new_cap >= LAYERS_NO_NODE);
+        layer_node_t *new_nodes = realloc(view->nodes, new_cap * sizeof(layer_node_t));
+        RETURN_FALSE_IF(NULL == new_nodes);
+        view->nodes = new_nodes;
+        view->nodes_cap = new_cap;
+    }
+
+    /* keep the hash table at most half full */
+    if (view->nnodes + 1 > (view->slots_mask + 1) / 2) {
+        size_t new_size = (view->slots_mask + 1) * 2;
+        uint32_t *new_slots = malloc(new_size * sizeof(uint32_t));
+        RETURN_FALSE_IF(NULL == new_slots);
+        memset(new_slots, 0xff, new_size * sizeof(uint32_t));
+
+        free(view->slots);
+        view->slots = new_slots;
+        view->slots_mask = new_size - 1;
+
+        uint32_t i;
+        for (i = 0; i < view->nnodes; ++i) {
+            view_insert_slot(view, i);
+        }
+    }
+
+    layer_node_t node;
+    memset(&node, 0, sizeof(node));
+    node.path = strndup(path, len);
+    RETURN_FALSE_IF(NULL == node.path);
+    node.owner = LAYERS_NONE;
+    node.deleted_by = LAYERS_NONE;
+    node.hidden_below_by = LAYERS_NONE;
+
+    index = view->nnodes++;
+    view->nodes[index] = node;
+    view_insert_slot(view, index);
+
+    *output_node = &view->nodes[index];
+    return true;
+}
+
+/* checks whether an upper layer owns, deletes or hides a path */
+static bool view_hidden(const layer_view_t *view, const char *path, int layer)
+{
+    uint32_t index = view_lookup(view, path, strlen(path));
+    if (index != LAYERS_NO_NODE && (view->nodes[index].owner > layer || view->nodes[index].deleted_by > layer)) {
+        return true;
+    }
+
+    /* the root and every parent directory */
+    size_t len = 0;
+    for (;;) {
+        index = view_lookup(view, path, len);
+        if (index != LAYERS_NO_NODE && view->nodes[index].hidden_below_by > layer) {
+            return true;
+        }
+
+        const char *separator = strchr(&path[(len > 0) ? len + 1 : 0], '/');
+        if (NULL == separator) {
+            break;
+        }
+        len = separator - path;
+    }
+
+    return false;
+}
+
+/* records where the contents of a file node are in its layer, for the hardlinks to it */
+static bool members_add_file(layer_view_t *members, const filedesc_t *file, const char *path, size_t ordinal,
+                             const char **output_data_path, size_t *output_data_ordinal)
+{
+    layer_node_t *member = NULL;
+    const char *data_path = path;
+    size_t data_ordinal = ordinal;
+
+    if (TYPEFLAG_LNK == file->type) {
+        char *target = NULL;
+        RETURN_FALSE_IF(NULL == file->linktarget);
+        RETURN_FALSE_IF(!path_normalize("", file->linktarget, &target));
+        uint32_t index = view_lookup(members, target, strlen(target));
+        free(target);
+
+        if (index == LAYERS_NO_NODE) {
+            /* not in this layer, it can only be linked by path */
+            data_path = NULL;
+            data_ordinal = LAYERS_UNRESOLVED;
+        } else {
+            data_path = (NULL != members->nodes[index].linktarget) ? members->nodes[index].linktarget : members->nodes[index].path;
+            data_ordinal = members->nodes[index].data_ordinal;
+        }
+    }
+
+    char *data_path_copy = (NULL != data_path && data_path != path) ? strdup(data_path) : NULL;
+    RETURN_FALSE_IF(NULL != data_path && data_path != path && NULL == data_path_copy);
+    if (!view_get(members, path, strlen(path), &member)) {
+        free(data_path_copy);
+        return false;
+    }
+    free(member->linktarget);
+    member->linktarget = data_path_copy;
+    member->data_ordinal = data_ordinal;
+
+    *output_data_path = (NULL != member->linktarget) ? member->linktarget : member->path;
+    *output_data_ordinal = data_ordinal;
+    return true;
+}
+
+static bool view_add_file(layer_view_t *view, layer_view_t *members, const filedesc_t *file, int layer, size_t ordinal)
+{
+    SASSERT(file->name != NULL);
+
+    char *path = NULL;
+    layer_node_t *node = NULL;
+    const char *data_path = NULL;
+    size_t data_ordinal = LAYERS_UNRESOLVED;
+
+    RETURN_FALSE_IF(!path_normalize((NULL != file->prefix) ? file->prefix : "", file->name, &path)); /* need cleanup after this line */
+    GOTO_CLEANUP_IF(!members_add_file(members, file, path, ordinal, &data_path, &data_ordinal));
+
+    char *base = strrchr(path, '/');
+    base = (NULL != base) ? base + 1 : path;
+    size_t dir_len = (base == path) ? 0 : (size_t)(base - path - 1);
+
+    if ('\0' == path[0]) {
+        /* the root directory itself is never extracted */
+
+    } else if (0 == strcmp(base, WHITEOUT_OPAQUE)) {
+        GOTO_CLEANUP_IF(!view_get(view, path, dir_len, &node));
+        node->hidden_below_by = (node->hidden_below_by > layer) ? node->hidden_below_by : layer;
+
+    } else if (0 == strncmp(base, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX))) {
+        memmove(base, base + strlen(WHITEOUT_PREFIX), strlen(base + strlen(WHITEOUT_PREFIX)) + 1);
+        GOTO_CLEANUP_IF(!view_get(view, path, strlen(path), &node));
+        node->deleted_by = (node->deleted_by > layer) ? node->deleted_by : layer;
+        node->hidden_below_by = (node->hidden_below_by > layer) ? node->hidden_below_by : layer;
+
+    } else if (!view_hidden(view, path, layer)) {
+        GOTO_CLEANUP_IF(!view_get(view, path, strlen(path), &node));
+
+        /* a later file node of the same layer replaces an earlier one */
+        free(node->linktarget);
+        node->linktarget = NULL;
+        node->owner = layer;
+        node->ordinal = ordinal;
+        node->type = file->type;
+        node->mode = file->mode;
+        node->data_ordinal = data_ordinal;
+
+        if (TYPEFLAG_LNK == file->type && LAYERS_UNRESOLVED == data_ordinal) {
+            GOTO_CLEANUP_IF(NULL == file->linktarget);
+            GOTO_CLEANUP_IF(!path_normalize("", file->linktarget, &node->linktarget));
+        } else if (TYPEFLAG_LNK == file->type) {
+            node->linktarget = strdup(data_path);
+            GOTO_CLEANUP_IF(NULL == node->linktarget);
+        }
+        if (TYPEFLAG_DIR != file->type) {
+            node->hidden_below_by = (node->hidden_below_by > layer) ? node->hidden_below_by : layer;
+        }
+    }
+
+    free(path);
+    return true;
+
+  cleanup:
+    free(path);
+    return false;
+}
+
+static void view_free(layer_view_t *view);
+
+static bool view_scan_layer(layer_view_t *view, FILE *layer, int index)
+{
+    filedesc_t file;
+    size_t ordinal = 0;
+    layer_view_t members;  /* all file nodes of this layer, visible or not */
+
+    if (!view_init(&members)) {
+        view_free(&members);
+        return false;
+    }
+
+    while (minutar_get_next_file(layer, &file)) {
+        if (TYPEFLAG_EOA == file.type) {
+            view_free(&members);
+            return true;
+        }
+
+        bool ok = view_add_file(view, &members, &file, index, ordinal++) && minutar_skip_file(layer, file);
+        minutar_free_filedesc(&file);
+        if (!ok) {
+            break;
+        }
+    }
+
+    view_free(&members);
+    return false;
+}
+
+static void view_free(layer_view_t *view)
+{
+    size_t i;
+    for (i = 0; i < view->nnodes; ++i) {
+        free(view->nodes[i].path);
+        free(view->nodes[i].linktarget);
+    }
+    free(view->nodes);
+    free(view->slots);
+}
+
+static int compare_node_path(const void *a, const void *b)
+{
+    const layer_node_t *node_a = *(const layer_node_t * const *)a;
+    const layer_node_t *node_b = *(const layer_node_t * const *)b;
+    return strcmp(node_a->path, node_b->path);
+}
+
+static int compare_node_position(const void *a, const void *b)
+{
+    const layer_node_t *node_a = *(const layer_node_t * const *)a;
+    const layer_node_t *node_b = *(const layer_node_t * const *)b;
+    if (node_a->owner != node_b->owner) {
+        return (node_a->owner < node_b->owner) ? -1 : 1;
+    }
+    return (node_a->ordinal < node_b->ordinal) ? -1 : (node_a->ordinal > node_b->ordinal);
+}
+
+static int compare_node_contents(const void *a, const void *b)
+{
+    const layer_node_t *node_a = *(const layer_node_t * const *)a;
+    const layer_node_t *node_b = *(const layer_node_t * const *)b;
+    if (node_a->owner != node_b->owner) {
+        return (node_a->owner < node_b->owner) ? -1 : 1;
+    }
+    if (node_a->data_ordinal != node_b->data_ordinal) {
+        return (node_a->data_ordinal < node_b->data_ordinal) ? -1 : 1;
+    }
+    return (node_a->ordinal < node_b->ordinal) ? -1 : (node_a->ordinal > node_b->ordinal);
+}
+
+/* outputs the owned nodes of one kind, sorted with "compare" */
+static bool view_select(const layer_view_t *view, bool directories, bool hardlinks,
+                        int (*compare)(const void *, const void *), layer_node_t ***output_nodes, size_t *output_count)
+{
+    layer_node_t **selected = malloc((view->nnodes + 1) * sizeof(layer_node_t *));
+    RETURN_FALSE_IF(NULL == selected);
+
+    size_t count = 0;
+    size_t i;
+    for (i = 0; i < view->nnodes; ++i) {
+        layer_node_t *node = &view->nodes[i];
+        if (node->owner != LAYERS_NONE &&
+            (TYPEFLAG_DIR == node->type) == directories &&
+            (TYPEFLAG_LNK == node->type) == hardlinks) {
+            selected[count++] = node;
+        }
+    }
+    qsort(selected, count, sizeof(layer_node_t *), compare);
+
+    *output_nodes = selected;
+    *output_count = count;
+    return true;
+}
+
+/* picks the hardlinks that take the contents of a target that didn't survive,
+ * outputs them sorted by the position of the contents */
+static bool view_promote_hardlinks(layer_view_t *view, layer_node_t *const *hardlinks, size_t nhardlinks,
+                                   layer_node_t ***output_promoted, size_t *output_count)
+{
+    layer_node_t **promoted = malloc((nhardlinks + 1) * sizeof(layer_node_t *));
+    RETURN_FALSE_IF(NULL == promoted);
+
+    size_t count = 0;
+    size_t i;
+    for (i = 0; i < nhardlinks; ++i) {
+        promoted[count++] = hardlinks[i];
+    }
+    qsort(promoted, count, sizeof(layer_node_t *), compare_node_contents);
+
+    size_t npromoted = 0;
+    layer_node_t *leader = NULL;
+    for (i = 0; i < count; ++i) {
+        layer_node_t *node = promoted[i];
+        if (LAYERS_UNRESOLVED == node->data_ordinal) {
+            continue;
+        }
+
+        if (NULL != leader && leader->owner == node->owner && leader->data_ordinal == node->data_ordinal) {
+            /* link to the hardlink that took the contents */
+            char *linktarget = strdup(leader->path);
+            GOTO_CLEANUP_IF(NULL == linktarget);
+            free(node->linktarget);
+            node->linktarget = linktarget;
+            continue;
+        }
+
+        uint32_t target = view_lookup(view, node->linktarget, strlen(node->linktarget));
+        if (target != LAYERS_NO_NODE &&
+            view->nodes[target].owner == node->owner && view->nodes[target].ordinal == node->data_ordinal) {
+            continue;
+        }
+        node->promoted = true;
+        leader = node;
+        promoted[npromoted++] = node;
+    }
+
+    *output_promoted = promoted;
+    *output_count = npromoted;
+    return true;
+
+  cleanup:
+    free(promoted);
+    return false;
+}
+
+/* finds the promoted hardlink that takes the contents of a file node */
+static const layer_node_t *find_promoted(layer_node_t *const *promoted, size_t npromoted, int index, size_t ordinal)
+{
+    size_t low = 0;
+    size_t high = npromoted;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const layer_node_t *node = promoted[middle];
+        if (node->owner == index && node->data_ordinal == ordinal) {
+            return node;
+        }
+        if (node->owner < index || (node->owner == index && node->data_ordinal < ordinal)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return NULL;
+}
+
+static bool extract_layer(const layer_view_t *view, layer_node_t *const *promoted, size_t npromoted, FILE *layer, int index)
+{
+    bool all_ok = true;
+    filedesc_t file;
+    size_t ordinal = 0;
+
+    while (minutar_get_next_file(layer, &file)) {
+        if (TYPEFLAG_EOA == file.type) {
+            return all_ok;
+        }
+
+        char *path = NULL;
+        uint32_t node = LAYERS_NO_NODE;
+        if (path_normalize((NULL != file.prefix) ? file.prefix : "", file.name, &path)) {
+            node = view_lookup(view, path, strlen(path));
+        }
+
+        bool extract = (TYPEFLAG_DIR != file.type && TYPEFLAG_LNK != file.type);
+        bool owned = (node != LAYERS_NO_NODE && view->nodes[node].owner == index && view->nodes[node].ordinal == ordinal);
+        const layer_node_t *hardlink = (extract && !owned) ? find_promoted(promoted, npromoted, index, ordinal) : NULL;
+
+        if (NULL != hardlink) {
+            /* the contents of a replaced or deleted target go to its hardlink */
+            free(path);
+            path = strdup(hardlink->path);
+            if (NULL == path) {
+                minutar_free_filedesc(&file);
+                return false;
+            }
+        }
+
+        if (extract && (owned || NULL != hardlink)) {
+            free(file.name);
+            file.name = path;
+            path = NULL;
+
+            if (!minutar_extract_file(layer, file)) {
+                fprintf(stderr, "failed to create '%s': %s\r\n", file.name, strerror(errno));
+                all_ok = false;
+            }
+        } else if (!minutar_skip_file(layer, file)) {
+            minutar_free_filedesc(&file);
+            free(path);
+            return false;
+        }
+
+        ordinal++;
+        minutar_free_filedesc(&file);
+        free(path);
+    }
+
+    return false;
+}
+
+/********************************* PUBLIC FUNCTIONS *********************************************/
+
+bool minutar_apply_layers(FILE *const *layers, size_t nlayers)
+{
+    SASSERT(layers != NULL);
+    SASSERT(nlayers < INT32_MAX);
+
+    bool all_ok = true;
+    layer_view_t view;
+    long *starts = NULL;
+    layer_node_t **directories = NULL;
+    layer_node_t **hardlinks = NULL;
+    layer_node_t **promoted = NULL;
+    size_t ndirectories = 0;
+    size_t nhardlinks = 0;
+    size_t npromoted = 0;
+    size_t i;
+
+    GOTO_CLEANUP_IF(!view_init(&view));
+    starts = malloc((nlayers + 1) * sizeof(long));
+    GOTO_CLEANUP_IF(NULL == starts);
+
+    /* find the owner of every path, from the top layer down */
+    for (i = nlayers; i > 0; --i) {
+        starts[i - 1] = ftell(layers[i - 1]);
+        GOTO_CLEANUP_IF(starts[i - 1] < 0);
+        if (!view_scan_layer(&view, layers[i - 1], (int)(i - 1))) {
+            fprintf(stderr, "failed to read layer %lu\r\n", (unsigned long)(i - 1));
+            goto cleanup;
+        }
+    }
+    GOTO_CLEANUP_IF(!view_select(&view, true, false, compare_node_path, &directories, &ndirectories));
+    GOTO_CLEANUP_IF(!view_select(&view, false, true, compare_node_position, &hardlinks, &nhardlinks));
+    GOTO_CLEANUP_IF(!view_promote_hardlinks(&view, hardlinks, nhardlinks, &promoted, &npromoted));
+
+    /* directories first, sorted so that parents come before their children */
+    for (i = 0; i < ndirectories; ++i) {
+        const char *path = directories[i]->path;
+        if (!path_mkdir(path, 0777) || (0 != mkdir(path, 0777) && errno != EEXIST)) {
+            fprintf(stderr, "failed to create '%s': %s\r\n", path, strerror(errno));
+            all_ok = false;
+        } else {
+            printf("%s d\r\n", path);
+        }
+    }
+
+    /* then the files, each from the layer that owns it */
+    for (i = 0; i < nlayers; ++i) {
+        if (0 != fseek(layers[i], starts[i], SEEK_SET) || !extract_layer(&view, promoted, npromoted, layers[i], (int)i)) {
+            fprintf(stderr, "failed to extract layer %lu\r\n", (unsigned long)i);
+            all_ok = false;
+        }
+    }
+
+    /* hardlinks after that, their target may be owned by any layer */
+    for (i = 0; i < nhardlinks; ++i) {
+        const char *path = hardlinks[i]->path;
+        if (hardlinks[i]->promoted) {
+            /* already extracted with the contents of its target */
+            continue;
+        }
+        SASSERT(hardlinks[i]->linktarget != NULL);
+        if (!path_mkdir(path, 0777) || 0 != link(hardlinks[i]->linktarget, path)) {
+            fprintf(stderr, "failed to create '%s': %s\r\n", path, strerror(errno));
+            all_ok = false;
+        } else {
+            printf("%s -> %s l\r\n", path, hardlinks[i]->linktarget);
+        }
+    }
+
+    /* directory modes last, so read-only directories can be filled */
+    for (i = ndirectories; i > 0; --i) {
+        if (0 != chmod(directories[i - 1]->path, directories[i - 1]->mode)) {
+            fprintf(stderr, "failed to set mode of '%s': %s\r\n", directories[i - 1]->path, strerror(errno));
+            all_ok = false;
+        }
+    }
+
+    free(promoted);
+    free(hardlinks);
+    free(directories);
+    free(starts);
+    view_free(&view);
+    return all_ok;
+
+  cleanup:
+    free(promoted);
+    free(hardlinks);
+    free(directories);
+    free(starts);
+    view_free(&view);
+    return false;
+}
@@ -0,0 +1,36 @@
+/*!
+ *  \file layers.h
+ *  \brief Interface for extracting stacked container image layers
+ *
+ */
+#ifndef MINUTAR_LAYERS_H_INCLUDED
+#define MINUTAR_LAYERS_H_INCLUDED
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*!
+ *  \fn bool minutar_apply_layers(FILE *const *layers, size_t nlayers)
+ *  \brief Extracts a stack of layer tape archives into one tree
+ *
+ *  "layers" are ordered from the bottom to the top layer, as in
+ *  an OCI image. The headers of all layers are scanned first to
+ *  find the final contents of the tree, following the OCI rules:
+ *  an upper layer replaces a path of a lower layer, ".wh.<name>"
+ *  deletes "<name>" and ".wh..wh..opq" hides everything that lower
+ *  layers have in its directory. Each surviving file node is then
+ *  extracted exactly once, from the layer that owns it. A hardlink
+ *  keeps the contents its target had in the hardlink's own layer,
+ *  even when an upper layer replaced or deleted that target.
+ *
+ *  The layers must be seekable, they are read twice from their
+ *  current read pointer.
+ *
+ *  Returns true if all layers were read and all surviving
+ *  file nodes were successfully extracted.
+ *
+ */
+bool minutar_apply_layers(FILE *const *layers, size_t nlayers);
+
+#endif /* MINUTAR_LAYERS_H_INCLUDED */
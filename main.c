@@ -2,8 +2,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "minutar.h"
+#include "decompress.h"
+#include "layers.h"
+#include "repack.h"
 
 /*
  * Simple test program to drive minutar
@@ -12,6 +16,53 @@
 int main(int argc, const char** argv)
 {
     FILE *input_file = NULL;
+    compression_t compression = COMPRESSION_NONE;
+    bool salvage = false;
+
+    /* -l: apply container image layers, from the bottom to the top one */
+    if (argc >= 3 && 0 == strcmp(argv[1], "-l")) {
+        FILE **layers = calloc(argc - 2, sizeof(FILE *));
+        int i;
+        if (NULL == layers) {
+            exit(2);
+        }
+        for (i = 2; i < argc; ++i) {
+            layers[i - 2] = fopen(argv[i], "rb");
+            if (NULL == layers[i - 2]) {
+                printf("open failed\r\n");
+                exit(2);
+            }
+        }
+        if (!minutar_apply_layers(layers, argc - 2)) {
+            printf("errors while processing the layers\r\n");
+            exit(3);
+        }
+        free(layers);
+        return 0;
+    }
+
+    /* -r: repack an archive with page aligned file contents */
+    if (argc == 4 && 0 == strcmp(argv[1], "-r")) {
+        FILE *output_file = NULL;
+        input_file = fopen(argv[2], "rb");
+        output_file = fopen(argv[3], "wb");
+        if (NULL == input_file || NULL == output_file) {
+            printf("open failed\r\n");
+            exit(2);
+        }
+        if (!minutar_repack(input_file, output_file, 4096) || 0 != fclose(output_file)) {
+            printf("errors while repacking the file\r\n");
+            exit(3);
+        }
+        return 0;
+    }
+
+    /* -s: salvage a damaged archive */
+    if (argc == 3 && 0 == strcmp(argv[1], "-s")) {
+        salvage = true;
+        argv++;
+        argc--;
+    }
 
     if (argc != 2) {
         printf("usage\r\n");
@@ -24,7 +75,16 @@ int main(int argc, const char** argv)
         exit(2);
     }
 
-    if (!minutar_extract_all(input_file)) {
+    compression = decompress_detect(input_file);
+    if (compression != COMPRESSION_NONE) {
+        input_file = decompress_open(input_file, compression, 0);
+        if (NULL == input_file) {
+            printf("decompression failed\r\n");
+            exit(2);
+        }
+    }
+
+    if (!(salvage ? minutar_extract_all_salvage(input_file) : minutar_extract_all(input_file))) {
          printf("errors while processing the file\r\n");
          exit(3);
     }
@@ -9,6 +9,7 @@
 
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -19,14 +20,6 @@
 #include "minutar.h"
 #include "util.h"
 
-#ifdef DEBUG
-#define RETURN_FALSE_IF(x) do{ if((x)){ fprintf(stderr, "%s returned false on line %u: (%s)\r\n", __FUNCTION__, __LINE__, #x); return false; } }while(0)
-#define GOTO_CLEANUP_IF(x) do{ if((x)){ fprintf(stderr, "%s returned false on line %u: (%s)\r\n", __FUNCTION__, __LINE__, #x); goto cleanup; } }while(0)
-#else /* DEBUG */
-#define RETURN_FALSE_IF(x) do{ if((x)){ return false; } }while(0)
-#define GOTO_CLEANUP_IF(x) do{ if((x)){ goto cleanup; } }while(0)
-#endif /* DEBUG */
-
 static const size_t TAR_BLOCKSIZE = 512;
 static const size_t TAR_HEADER_NAME_OFFSET = 0;
 static const size_t TAR_HEADER_NAME_WIDTH = 100;
@@ -56,6 +49,34 @@ static const size_t TAR_HEADER_PREFIX_OFFSET = 345;
 static const size_t TAR_HEADER_PREFIX_WIDTH = 155;
 static const char   TAR_EOA_HEADER[512] = {0};
 static const char  *TAR_HEADER_MAGIC_VALUE = "ustar";
+static const size_t TAR_RESYNC_BATCH = 16; /* blocks read at a time while looking for a header */
+static const size_t TAR_GNULONG_MAX = 0x100000;
+static const size_t TAR_PAX_MAX = 0x100000;
+static const char  *TAR_PAX_COMMENT_KEYWORD = "comment";
+
+typedef enum {
+    PUSHSTATE_HEADER,       /* collecting a header block */
+    PUSHSTATE_GNULONG,      /* collecting a GNU long name, link target or POSIX extended header */
+    PUSHSTATE_DATA,         /* passing through file contents */
+    PUSHSTATE_PADDING,      /* skipping to the next block boundary */
+    PUSHSTATE_END,          /* end-of-archive reached */
+    PUSHSTATE_ERROR         /* invalid input, no recovery */
+} pushstate_t;
+
+struct pushparser_s {
+    pushstate_t state;
+    char header[sizeof(TAR_EOA_HEADER)];    /* partial header block */
+    size_t header_len;
+    bool zero_block;        /* first block of the end-of-archive indicator was seen */
+    char *longname;         /* GNU long name for the next file node */
+    char *longlink;         /* GNU long link target for the next file node */
+    char *gnulong;          /* GNU long name or POSIX extended header being collected */
+    typeflag_t gnulong_type;
+    size_t gnulong_size;
+    size_t gnulong_len;
+    size_t data_left;       /* bytes left in PUSHSTATE_DATA */
+    size_t padding_left;    /* bytes left in PUSHSTATE_PADDING */
+};
 
 
 typeflag_t typeflag_from_byte(const uint8_t byte)
@@ -103,7 +124,7 @@ char *parse_string_field(const char *field, size_t width)
     memcpy(tmp, field, width);
     tmp[width] = '\0';
     /* TODO: validate utf-8? */
-    return strdup(field);
+    return strdup(tmp);
 }
 
 bool parse_octal_uint_field(const char *field, size_t width, size_t *output_value)
@@ -157,6 +178,13 @@ bool ustar_header_chksum_verify(const char raw_header[TAR_BLOCKSIZE])
     return (calculated == expected);
 }
 
+bool ustar_header_candidate(const char raw_header[TAR_BLOCKSIZE])
+{
+    /* cheap magic compare first, the checksum covers the whole block */
+    return (0 == memcmp(&raw_header[TAR_HEADER_MAGIC_OFFSET], TAR_HEADER_MAGIC_VALUE, strlen(TAR_HEADER_MAGIC_VALUE)))
+        && ustar_header_chksum_verify(raw_header);
+}
+
 bool validate_mode_and_type(size_t mode, typeflag_t type)
 {
     switch (type)
@@ -273,7 +301,7 @@ bool read_gnulong_name(FILE *tarfile, size_t read_size, char **output_name)
 
     char *data = NULL;
 
-    RETURN_FALSE_IF(read_size > 0x100000);
+    RETURN_FALSE_IF(read_size > TAR_GNULONG_MAX);
     data = malloc(read_size+1);
     RETURN_FALSE_IF(NULL == data); /* need cleanup after this line */
 
@@ -290,6 +318,57 @@ bool read_gnulong_name(FILE *tarfile, size_t read_size, char **output_name)
     return false;
 }
 
+bool pax_records_ignorable(const char *data, size_t len)
+{
+    SASSERT(data != NULL || len == 0);
+
+    /* records are "<length> <keyword>=<value>\n", the length includes itself */
+    size_t pos = 0;
+    while (pos < len) {
+        const char *record = &data[pos];
+        size_t record_len = 0;
+        size_t i = 0;
+
+        while (pos + i < len && record[i] >= '0' && record[i] <= '9') {
+            RETURN_FALSE_IF(record_len > len);
+            record_len = record_len * 10 + (record[i] - '0');
+            ++i;
+        }
+        RETURN_FALSE_IF(i == 0 || record_len > len - pos || record_len <= i + 1);
+        RETURN_FALSE_IF(record[i] != ' ' || record[record_len - 1] != '\n');
+
+        /* only comments can be ignored, anything else would change the file node */
+        const char *keyword = &record[i + 1];
+        size_t keyword_len = strlen(TAR_PAX_COMMENT_KEYWORD);
+        RETURN_FALSE_IF(record_len - (i + 1) <= keyword_len);
+        RETURN_FALSE_IF(0 != memcmp(keyword, TAR_PAX_COMMENT_KEYWORD, keyword_len) || keyword[keyword_len] != '=');
+
+        pos += record_len;
+    }
+    return true;
+}
+
+bool skip_pax_header(FILE *tarfile, size_t read_size)
+{
+    SASSERT(tarfile != NULL);
+
+    char *data = NULL;
+
+    RETURN_FALSE_IF(read_size > TAR_PAX_MAX);
+    data = malloc(read_size+1);
+    RETURN_FALSE_IF(NULL == data); /* need cleanup after this line */
+
+    GOTO_CLEANUP_IF(fread(data, 1, read_size, tarfile) != read_size);
+    GOTO_CLEANUP_IF(!pax_records_ignorable(data, read_size));
+
+    free(data);
+    return true;
+
+  cleanup:
+    free(data);
+    return false;
+}
+
 bool parse_gnulong_headers(FILE *tarfile, const filedesc_t first_header, filedesc_t *output_nextfile)
 {
     SASSERT(tarfile != NULL);
@@ -358,6 +437,30 @@ bool parse_gnulong_headers(FILE *tarfile, const filedesc_t first_header, filedes
     return false;
 }
 
+void *map_file_contents(FILE *tarfile, size_t size)
+{
+    SASSERT(tarfile != NULL);
+    SASSERT(size > 0);
+
+    /* only page aligned contents of a regular file can be mapped, like
+     * the members of an archive written by minutar_repack() */
+    int tarfd = fileno(tarfile);
+    long data_offset = ftell(tarfile);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (tarfd < 0 || data_offset < 0 || page_size <= 0 || data_offset % page_size != 0) {
+        return NULL;
+    }
+
+    /* a mapping beyond the end of a truncated archive would fault */
+    struct stat tarstat;
+    if (fstat(tarfd, &tarstat) != 0 || !S_ISREG(tarstat.st_mode) || (size_t)(tarstat.st_size - data_offset) < size) {
+        return NULL;
+    }
+
+    void *contents = mmap(NULL, size, PROT_READ, MAP_PRIVATE, tarfd, data_offset);
+    return (MAP_FAILED == contents) ? NULL : contents;
+}
+
 bool extract_file_contents(FILE *tarfile, const filedesc_t file)
 {
     SASSERT(tarfile != NULL);
@@ -369,7 +472,25 @@ bool extract_file_contents(FILE *tarfile, const filedesc_t file)
 
     GOTO_CLEANUP_IF(chmod(file.name, file.mode) != 0);
 
-    if (file.size > 0) {
+    void *contents = (file.size > 0) ? map_file_contents(tarfile, file.size) : NULL;
+    if (NULL != contents) {
+        /* write() the mapping past the stdio buffer, so the contents
+         * go from the page cache of the archive to the file unbuffered */
+        bool written = (fflush(output) == 0);
+        size_t bytes_done = 0;
+        while (written && bytes_done < file.size) {
+            ssize_t len = write(fileno(output), (const uint8_t *)contents + bytes_done, file.size - bytes_done);
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            written = (len > 0);
+            bytes_done += (len > 0) ? (size_t)len : 0;
+        }
+        munmap(contents, file.size);
+        GOTO_CLEANUP_IF(!written);
+        GOTO_CLEANUP_IF(fseek(tarfile, file.size, SEEK_CUR) != 0);
+
+    } else if (file.size > 0) {
         uint8_t tmp_data[1024];
         size_t bytes_left = file.size;
 
@@ -415,7 +536,7 @@ bool extract_file(FILE *tarfile, const filedesc_t file)
 
     case TYPEFLAG_REG:
     case TYPEFLAG_CONT:
-        RETURN_FALSE_IF(extract_file_contents(tarfile, file));
+        RETURN_FALSE_IF(!extract_file_contents(tarfile, file));
         printf("%s %lu\r\n", file.name, (unsigned long)file.size);
         break;
 
@@ -439,9 +560,218 @@ bool extract_file(FILE *tarfile, const filedesc_t file)
     return true;
 }
 
+size_t min_size(size_t a, size_t b)
+{
+    return (a < b) ? a : b;
+}
+
+size_t block_padding(size_t size)
+{
+    return (TAR_BLOCKSIZE - (size % TAR_BLOCKSIZE)) % TAR_BLOCKSIZE;
+}
+
+bool push_header(pushparser_t *parser, const char raw_header[TAR_BLOCKSIZE], pushevent_t *output_event)
+{
+    SASSERT(parser != NULL);
+    SASSERT(output_event != NULL);
+
+    filedesc_t header;
+
+    /* handle end of archive condition, two zero blocks in a row */
+    if (0 == memcmp(raw_header, TAR_EOA_HEADER, TAR_BLOCKSIZE)) {
+        if (parser->zero_block) {
+            parser->state = PUSHSTATE_END;
+            output_event->type = PUSHEVENT_END_OF_ARCHIVE;
+        }
+        parser->zero_block = true;
+        return true;
+    }
+    RETURN_FALSE_IF(parser->zero_block);
+
+    RETURN_FALSE_IF(!parse_ustar_header(raw_header, &header)); /* need cleanup after this line */
+
+    switch (header.type)
+    {
+    case TYPEFLAG_XHD:
+        /* like minutar_get_next_file(), only before any GNU long name */
+        GOTO_CLEANUP_IF(NULL != parser->longname || NULL != parser->longlink);
+        /* fall through */
+    case TYPEFLAG_GNUL:
+    case TYPEFLAG_GNUK:
+        /* only accept one long name and one long link target per file node */
+        GOTO_CLEANUP_IF(TYPEFLAG_GNUL == header.type && NULL != parser->longname);
+        GOTO_CLEANUP_IF(TYPEFLAG_GNUK == header.type && NULL != parser->longlink);
+        GOTO_CLEANUP_IF(header.size > (TYPEFLAG_XHD == header.type ? TAR_PAX_MAX : TAR_GNULONG_MAX));
+
+        parser->gnulong = malloc(header.size+1);
+        GOTO_CLEANUP_IF(NULL == parser->gnulong);
+        parser->gnulong_type = header.type;
+        parser->gnulong_size = header.size;
+        parser->gnulong_len = 0;
+        parser->padding_left = block_padding(header.size);
+        parser->state = PUSHSTATE_GNULONG;
+        minutar_free_filedesc(&header);
+        return true;
+
+    case TYPEFLAG_XGL:
+        GOTO_CLEANUP_IF("not supported extended header");
+
+    default:
+        break;
+    }
+
+    if (NULL != parser->longname) {
+        free(header.name);
+        header.name = parser->longname;
+        parser->longname = NULL;
+    }
+    if (NULL != parser->longlink) {
+        if (NULL != header.linktarget) {
+            free(header.linktarget);
+        }
+        header.linktarget = parser->longlink;
+        parser->longlink = NULL;
+    }
+    GOTO_CLEANUP_IF(!canonicalize_paths(&header));
+
+    parser->data_left = header.size;
+    parser->padding_left = block_padding(header.size);
+    parser->state = PUSHSTATE_DATA;
+
+    SASSERT(header.type >= TYPEFLAG_REG && header.type <= TYPEFLAG_CONT);
+    output_event->type = PUSHEVENT_HEADER;
+    output_event->file = header;
+    return true;
+
+  cleanup:
+    minutar_free_filedesc(&header);
+    return false;
+}
+
+bool push_gnulong(pushparser_t *parser)
+{
+    SASSERT(parser != NULL);
+    SASSERT(parser->gnulong != NULL);
+
+    char *data = parser->gnulong;
+    parser->gnulong = NULL;
+    parser->state = PUSHSTATE_PADDING;
+
+    if (TYPEFLAG_XHD == parser->gnulong_type) {
+        bool ignorable = pax_records_ignorable(data, parser->gnulong_size);
+        free(data);
+        return ignorable;
+    }
+
+    data[parser->gnulong_size] = '\0';
+    if (strlen(data)+1 != parser->gnulong_size) {
+        free(data);
+        return false;
+    }
+
+    if (TYPEFLAG_GNUL == parser->gnulong_type) {
+        parser->longname = data;
+    } else /* parser->gnulong_type == TYPEFLAG_GNUK */ {
+        parser->longlink = data;
+    }
+    return true;
+}
+
+bool push_next(pushparser_t *parser, const char **input, size_t *input_len, pushevent_t *output_event)
+{
+    SASSERT(parser != NULL);
+    SASSERT(input != NULL);
+    SASSERT(input_len != NULL);
+    SASSERT(output_event != NULL);
+
+    size_t len;
+
+    while (PUSHEVENT_NONE == output_event->type) {
+        switch (parser->state)
+        {
+        case PUSHSTATE_HEADER:
+            if (0 == parser->header_len && *input_len >= TAR_BLOCKSIZE) {
+                /* whole header in the input, no need to copy it */
+                const char *raw_header = *input;
+                *input += TAR_BLOCKSIZE;
+                *input_len -= TAR_BLOCKSIZE;
+                RETURN_FALSE_IF(!push_header(parser, raw_header, output_event));
+                break;
+            }
+            len = min_size(TAR_BLOCKSIZE - parser->header_len, *input_len);
+            memcpy(&parser->header[parser->header_len], *input, len);
+            parser->header_len += len;
+            *input += len;
+            *input_len -= len;
+            if (parser->header_len < TAR_BLOCKSIZE) {
+                return true;
+            }
+            parser->header_len = 0;
+            RETURN_FALSE_IF(!push_header(parser, parser->header, output_event));
+            break;
+
+        case PUSHSTATE_GNULONG:
+            len = min_size(parser->gnulong_size - parser->gnulong_len, *input_len);
+            memcpy(&parser->gnulong[parser->gnulong_len], *input, len);
+            parser->gnulong_len += len;
+            *input += len;
+            *input_len -= len;
+            if (parser->gnulong_len < parser->gnulong_size) {
+                return true;
+            }
+            RETURN_FALSE_IF(!push_gnulong(parser));
+            break;
+
+        case PUSHSTATE_DATA:
+            if (0 == parser->data_left) {
+                /* don't hold back the end of the file for its padding */
+                parser->state = PUSHSTATE_PADDING;
+                output_event->type = PUSHEVENT_END_OF_FILE;
+                break;
+            }
+            if (0 == *input_len) {
+                return true;
+            }
+            len = min_size(parser->data_left, *input_len);
+            output_event->type = PUSHEVENT_DATA;
+            output_event->data = *input;
+            output_event->len = len;
+            parser->data_left -= len;
+            *input += len;
+            *input_len -= len;
+            break;
+
+        case PUSHSTATE_PADDING:
+            len = min_size(parser->padding_left, *input_len);
+            parser->padding_left -= len;
+            *input += len;
+            *input_len -= len;
+            if (parser->padding_left > 0) {
+                return true;
+            }
+            parser->state = PUSHSTATE_HEADER;
+            break;
+
+        case PUSHSTATE_END:
+            /* ignore the rest of the last record */
+            *input += *input_len;
+            *input_len = 0;
+            return true;
+
+        case PUSHSTATE_ERROR:
+            return false;
+
+        default:
+            SUNREACHABLE();
+        }
+    }
+
+    return true;
+}
+
 /********************************* PUBLIC FUNCTIONS *********************************************/
 
-bool minutar_next_file(FILE *tarfile, filedesc_t *output_nextfile)
+bool minutar_get_next_file(FILE *tarfile, filedesc_t *output_nextfile)
 {
     SASSERT(tarfile != NULL);
     SASSERT(output_nextfile != NULL);
@@ -451,6 +781,13 @@ bool minutar_next_file(FILE *tarfile, filedesc_t *output_nextfile)
 
     RETURN_FALSE_IF(!read_ustar_header(tarfile, &nextfile)); /* need clenaup after this line */
 
+    /* skip POSIX extended headers that only hold comments, like alignment padding */
+    while (TYPEFLAG_XHD == nextfile.type) {
+        GOTO_CLEANUP_IF(!skip_pax_header(tarfile, nextfile.size));
+        minutar_free_filedesc(&nextfile);
+        GOTO_CLEANUP_IF(!read_ustar_header(tarfile, &nextfile));
+    }
+
     /* handle extended headers */
     if (nextfile.type > TYPEFLAG_CONT && nextfile.type != TYPEFLAG_EOA) {
         switch ( nextfile.type )
@@ -471,7 +808,9 @@ bool minutar_next_file(FILE *tarfile, filedesc_t *output_nextfile)
         }
     }
 
-    GOTO_CLEANUP_IF(!canonicalize_paths(&nextfile));
+    if (TYPEFLAG_EOA != nextfile.type) {
+        GOTO_CLEANUP_IF(!canonicalize_paths(&nextfile));
+    }
 
     SASSERT((nextfile.type >= TYPEFLAG_REG && nextfile.type <= TYPEFLAG_CONT) || nextfile.type == TYPEFLAG_EOA);
     *output_nextfile = nextfile;
@@ -509,18 +848,86 @@ void minutar_free_filedesc(filedesc_t *file)
     }
 }
 
-bool minutar_extract_all(FILE *tarfile)
+bool minutar_extract_file(FILE *tarfile, const filedesc_t file)
+{
+    SASSERT(tarfile != NULL);
+    SASSERT(file.name != NULL);
+
+    RETURN_FALSE_IF(!path_mkdir(file.name, 0777));
+    return extract_file(tarfile, file);
+}
+
+bool minutar_resync(FILE *tarfile)
+{
+    SASSERT(tarfile != NULL);
+
+    char blocks[TAR_RESYNC_BATCH][TAR_BLOCKSIZE];
+
+    /* align file read pointer to TAR_BLOCKSIZE */
+    long fpos = ftell(tarfile);
+    RETURN_FALSE_IF( fpos < 0 );
+    if (fpos % TAR_BLOCKSIZE != 0) {
+        size_t skip_len = TAR_BLOCKSIZE - (fpos % TAR_BLOCKSIZE);
+        RETURN_FALSE_IF(fseek(tarfile, skip_len, SEEK_CUR) != 0);
+    }
+
+    for (;;) {
+        long batch_pos = ftell(tarfile);
+        RETURN_FALSE_IF( batch_pos < 0 );
+        size_t nblocks = fread(blocks, TAR_BLOCKSIZE, TAR_RESYNC_BATCH, tarfile);
+
+        size_t i;
+        for (i = 0; i < nblocks; ++i) {
+            if (ustar_header_candidate(blocks[i])) {
+                /* seek back to the header, so it is read again by minutar_get_next_file,
+                 * relative to the batch since fread also consumed any partial last block */
+                RETURN_FALSE_IF(fseek(tarfile, batch_pos + (long)(i * TAR_BLOCKSIZE), SEEK_SET) != 0);
+                return true;
+            }
+        }
+
+        RETURN_FALSE_IF(nblocks < TAR_RESYNC_BATCH);
+    }
+}
+
+bool extract_all(FILE *tarfile, bool salvage)
 {
     SASSERT(tarfile != NULL);
 
     bool all_ok = true;
     filedesc_t next_file;
 
-    while (minutar_next_file(tarfile, &next_file))
+    for (;;)
     {
+        long header_pos = ftell(tarfile);
+
+        if (!minutar_get_next_file(tarfile, &next_file)) {
+            if (!salvage || header_pos < 0) {
+                break;
+            }
+            all_ok = false;
+
+            /* skip the header that failed and look for the next valid one */
+            header_pos += (TAR_BLOCKSIZE - (header_pos % TAR_BLOCKSIZE)) % TAR_BLOCKSIZE;
+            if (fseek(tarfile, header_pos + TAR_BLOCKSIZE, SEEK_SET) != 0 || !minutar_resync(tarfile)) {
+                fprintf(stderr, "damaged archive from offset %ld to the end\r\n", header_pos);
+                break;
+            }
+            fprintf(stderr, "skipped damaged archive from offset %ld to %ld\r\n", header_pos, ftell(tarfile));
+            continue;
+        }
+
         if (TYPEFLAG_EOA == next_file.type) {
             /* don't need to free EOA filedesc_t, since no malloc'ed content */
-            break;
+            if (!salvage || header_pos < 0 || !minutar_resync(tarfile)) {
+                break;
+            }
+
+            /* zeroed blocks followed by more headers, like an unfinished upload */
+            all_ok = false;
+            header_pos += (TAR_BLOCKSIZE - (header_pos % TAR_BLOCKSIZE)) % TAR_BLOCKSIZE;
+            fprintf(stderr, "skipped zeroed archive from offset %ld to %ld\r\n", header_pos, ftell(tarfile));
+            continue;
         }
 
         if (!path_mkdir(next_file.name, 0777) && errno != EEXIST) {
@@ -539,3 +946,57 @@ bool minutar_extract_all(FILE *tarfile)
 
     return all_ok;
 }
+
+bool minutar_extract_all(FILE *tarfile)
+{
+    return extract_all(tarfile, false);
+}
+
+bool minutar_extract_all_salvage(FILE *tarfile)
+{
+    return extract_all(tarfile, true);
+}
+
+pushparser_t *minutar_pushparser_create(void)
+{
+    pushparser_t *parser = calloc(1, sizeof(*parser));
+    if (NULL == parser) {
+        return NULL;
+    }
+    parser->state = PUSHSTATE_HEADER;
+    return parser;
+}
+
+void minutar_pushparser_free(pushparser_t *parser)
+{
+    if (NULL == parser) {
+        return;
+    }
+    free(parser->longname);
+    free(parser->longlink);
+    free(parser->gnulong);
+    free(parser);
+}
+
+bool minutar_push(pushparser_t *parser, const void **input, size_t *input_len, pushevent_t *output_event)
+{
+    SASSERT(parser != NULL);
+    SASSERT(input != NULL);
+    SASSERT(input_len != NULL);
+    SASSERT(*input != NULL || *input_len == 0);
+    SASSERT(output_event != NULL);
+
+    const char *next_input = *input;
+
+    memset(output_event, 0, sizeof(*output_event));
+    output_event->type = PUSHEVENT_NONE;
+
+    if (!push_next(parser, &next_input, input_len, output_event)) {
+        parser->state = PUSHSTATE_ERROR;
+        *input = next_input;
+        return false;
+    }
+
+    *input = next_input;
+    return true;
+}
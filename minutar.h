@@ -67,6 +67,10 @@ typedef struct filedesc_s {
  *  of the output datastructure will have value TYPEFLAG_EOA.
  *  Returns false if no valid next file could be read.
  *
+ *  POSIX extended headers are only accepted when they hold
+ *  nothing but comments, like the alignment padding written
+ *  by minutar_repack(), and are skipped.
+ *
  *  The function advances the "tarfile" read pointer so
  *  that it is ready to read the file contents, if any.
  *
@@ -96,6 +100,21 @@ bool minutar_skip_file(FILE *tarfile, const filedesc_t skip_file);
  */
 void minutar_free_filedesc(filedesc_t *file);
 
+/*!
+ *  \fn bool minutar_extract_file(FILE *tarfile, const filedesc_t file)
+ *  \brief Extracts a file in the tape archive
+ *
+ *  The "tarfile" read pointer must be where minutar_get_next_file()
+ *  left it after outputting "file". Missing parent directories of
+ *  the file are created. Page aligned contents in a regular file
+ *  are written from a mapping of the archive, without going through
+ *  a user space buffer.
+ *
+ *  Returns true on success, caller should check errno on failure.
+ *
+ */
+bool minutar_extract_file(FILE *tarfile, const filedesc_t file);
+
 /*!
  * \fn bool minutar_extract_all(FILE *tarfile)
  * \brief Extract all files in a tape archive
@@ -105,4 +124,110 @@ void minutar_free_filedesc(filedesc_t *file);
  */
 bool minutar_extract_all(FILE *tarfile);
 
+/*!
+ *  \fn bool minutar_resync(FILE *tarfile)
+ *  \brief Skips forward to the next valid header in the tape archive
+ *
+ *  Scans the archive block by block from the current read
+ *  pointer, for a block with the ustar magic value and a valid
+ *  checksum. The read pointer is left at that block, so that
+ *  minutar_get_next_file() can continue from there.
+ *
+ *  Returns false if no valid header was found before the end
+ *  of the file, caller should check feof(), ferror() and errno.
+ *
+ */
+bool minutar_resync(FILE *tarfile);
+
+/*!
+ * \fn bool minutar_extract_all_salvage(FILE *tarfile)
+ * \brief Extract all files in a damaged tape archive
+ *
+ * Like minutar_extract_all(), but when a header can't be read
+ * extraction resumes at the next valid header found with
+ * minutar_resync(). An end-of-archive indicator that is followed
+ * by a valid header is taken as a zeroed range and skipped too.
+ * Each skipped range is reported on stderr.
+ *
+ * Returns true if the archive was undamaged and all files
+ * are successullfy extracted.
+ *
+ */
+bool minutar_extract_all_salvage(FILE *tarfile);
+
+/*!
+ * \enum pusheventtype_t
+ * \brief Datastructure that indicates the kind of event output by minutar_push
+ *
+ */
+typedef enum {
+    PUSHEVENT_NONE,             /*! all input was consumed, more is needed for the next event */
+    PUSHEVENT_HEADER,           /*! a file node starts, described by the "file" field */
+    PUSHEVENT_DATA,             /*! a chunk of the contents of the current file node */
+    PUSHEVENT_END_OF_FILE,      /*! all contents of the current file node were output */
+    PUSHEVENT_END_OF_ARCHIVE    /*! the end-of-archive indicator was reached */
+} pusheventtype_t;
+
+/*!
+ * \struct pushevent_t
+ * \brief Datastructure that describes an event output by minutar_push
+ *
+ */
+typedef struct pushevent_s {
+    pusheventtype_t type;   /*! the kind of event */
+    filedesc_t file;        /*! for PUSHEVENT_HEADER, the file node, owned by the caller */
+    const void *data;       /*! for PUSHEVENT_DATA, points into the input passed to minutar_push */
+    size_t len;             /*! for PUSHEVENT_DATA, the number of bytes at "data" */
+} pushevent_t;
+
+/*!
+ * \struct pushparser_t
+ * \brief Opaque state of a tape archive parser that is fed with input
+ *
+ */
+typedef struct pushparser_s pushparser_t;
+
+/*!
+ *  \fn pushparser_t *minutar_pushparser_create(void)
+ *  \brief Creates a parser for a tape archive that arrives in chunks
+ *
+ *  Returns NULL on failure, caller should check errno.
+ *  The caller must call minutar_pushparser_free() on the result.
+ *
+ */
+pushparser_t *minutar_pushparser_create(void);
+
+/*!
+ *  \fn void minutar_pushparser_free(pushparser_t *parser)
+ *  \brief Frees a parser returned by minutar_pushparser_create
+ *
+ */
+void minutar_pushparser_free(pushparser_t *parser);
+
+/*!
+ *  \fn bool minutar_push(pushparser_t *parser, const void **input, size_t *input_len, pushevent_t *output_event)
+ *  \brief Feeds input to a parser and gets the next event
+ *
+ *  Consumes bytes from "input", advancing it and decreasing
+ *  "input_len", until an event can be output. The input may be
+ *  split anywhere, a partial header or GNU long name is kept by
+ *  the parser until the rest arrives. When all input is consumed
+ *  without completing an event, PUSHEVENT_NONE is output and the
+ *  caller should call again with the next chunk of input.
+ *
+ *  The function never blocks and copies no file contents, the
+ *  parser holds at most one header and the GNU long names of one
+ *  file node. Each file node is output as one PUSHEVENT_HEADER,
+ *  zero or more PUSHEVENT_DATA and one PUSHEVENT_END_OF_FILE.
+ *  Input after PUSHEVENT_END_OF_ARCHIVE is consumed and ignored.
+ *
+ *  For PUSHEVENT_HEADER the caller must call minutar_free_filedesc()
+ *  on the "file" field.
+ *
+ *  Returns false if the input is not a valid tape archive,
+ *  all later calls on the parser will return false too.
+ *
+ */
+bool minutar_push(pushparser_t *parser, const void **input, size_t *input_len, pushevent_t *output_event);
+
 #endif /* MINUTAR_H_INCLUDED */
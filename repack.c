@@ -0,0 +1,533 @@
+/*!
+ *  \file repack.c
+ *  \brief Rewriting tape archives with aligned file contents
+ *
+ *  The input is scanned first to find where the headers and contents
+ *  of each file node are. The file nodes are then sorted for
+ *  extraction and copied to the output block for block, with a POSIX
+ *  extended header in front of the headers when the contents would
+ *  otherwise not start on an alignment boundary.
+ *
+ *  Only the last file node of a path is written. A hardlink that
+ *  refers to an earlier one, which a later file node replaced, gets
+ *  its headers rewritten: the first such hardlink becomes a regular
+ *  file with the contents of the replaced file node, and the others
+ *  link to that one.
+ *
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "sassert.h"
+#include "minutar.h"
+#include "util.h"
+#include "repack.h"
+
+static const size_t TAR_BLOCKSIZE = 512;
+static const size_t TAR_HEADER_NAME_OFFSET = 0;
+static const size_t TAR_HEADER_MODE_OFFSET = 100;
+static const size_t TAR_HEADER_SIZE_OFFSET = 124;
+static const size_t TAR_HEADER_SIZE_WIDTH = 12;
+static const size_t TAR_HEADER_MTIME_OFFSET = 136;
+static const size_t TAR_HEADER_CHKSUM_OFFSET = 148;
+static const size_t TAR_HEADER_CHKSUM_WIDTH = 8;
+static const size_t TAR_HEADER_TYPE_OFFSET = 156;
+static const size_t TAR_HEADER_LINK_OFFSET = 157;
+static const size_t TAR_HEADER_LINK_WIDTH = 100;
+static const size_t TAR_HEADER_MAGIC_OFFSET = 257;
+static const char   TAR_ZERO_BLOCK[512] = {0};
+static const char  *REPACK_PADDING_NAME = "././@PaxHeader";
+static const char  *REPACK_PADDING_RECORD = " comment=";
+static const char  *REPACK_LONGLINK_NAME = "././@LongLink";
+static const size_t REPACK_MAX_SIZE = 077777777777; /* largest octal size field */
+static const size_t REPACK_INITIAL_MEMBERS = 1024;
+static const size_t REPACK_COPY_BUFSIZE = 0x10000;
+
+typedef struct repack_member_s {
+    char *path;             /* normalized prefix and name as a malloc()ed string */
+    char *linktarget;       /* normalized hardlink target as a malloc()ed string */
+    typeflag_t type;
+    size_t size;
+    long header_offset;     /* first header of the file node, after any extended header */
+    long data_offset;       /* contents of the file node, right after its headers */
+    size_t ordinal;         /* position of the file node in the input */
+    int rank;               /* extraction group, see member_rank() */
+    bool kept;              /* last file node of its path, the one that is written */
+    const struct repack_member_s *contents; /* hardlinks written as a file: the replaced file node with the contents */
+    const struct repack_member_s *relink;   /* hardlinks written with another target: the file node to link to */
+    const struct repack_member_s *leader;   /* replaced file nodes: the hardlink that was written with the contents */
+} repack_member_t;
+
+typedef struct repack_list_s {
+    repack_member_t *members;
+    size_t nmembers;
+    size_t members_cap;
+} repack_list_t;
+
+
+static size_t block_roundup(size_t size)
+{
+    return (size + TAR_BLOCKSIZE - 1) / TAR_BLOCKSIZE * TAR_BLOCKSIZE;
+}
+
+static int member_rank(typeflag_t type, size_t size, size_t alignment)
+{
+    switch (type)
+    {
+    case TYPEFLAG_DIR:
+        return 0;
+    case TYPEFLAG_REG:
+    case TYPEFLAG_CONT:
+        return (size < alignment) ? 1 : 2;
+    case TYPEFLAG_LNK:
+        /* after every other file node, so the targets exist */
+        return 4;
+    default:
+        return 3;
+    }
+}
+
+static size_t header_size(const char raw_header[TAR_BLOCKSIZE])
+{
+    char size_field[TAR_HEADER_SIZE_WIDTH + 1];
+    memcpy(size_field, &raw_header[TAR_HEADER_SIZE_OFFSET], TAR_HEADER_SIZE_WIDTH);
+    size_field[TAR_HEADER_SIZE_WIDTH] = '\0';
+    return strtoul(size_field, NULL, 8);
+}
+
+static void header_set_chksum(char raw_header[TAR_BLOCKSIZE])
+{
+    memset(&raw_header[TAR_HEADER_CHKSUM_OFFSET], ' ', TAR_HEADER_CHKSUM_WIDTH);
+
+    size_t chksum = 0;
+    size_t i;
+    for (i = 0; i < TAR_BLOCKSIZE; ++i) {
+        chksum += (uint8_t)raw_header[i];
+    }
+    sprintf(&raw_header[TAR_HEADER_CHKSUM_OFFSET], "%06lo", (unsigned long)chksum);
+    raw_header[TAR_HEADER_CHKSUM_OFFSET + 7] = ' ';
+}
+
+/* fills a header for an entry that is not a file node, "magic" includes the version */
+static void header_fill(char raw_header[TAR_BLOCKSIZE], const char *name, typeflag_t type, size_t size, const char *magic)
+{
+    memset(raw_header, 0, TAR_BLOCKSIZE);
+    strcpy(&raw_header[TAR_HEADER_NAME_OFFSET], name);
+    strcpy(&raw_header[TAR_HEADER_MODE_OFFSET], "0000644");
+    sprintf(&raw_header[TAR_HEADER_SIZE_OFFSET], "%011lo", (unsigned long)size);
+    strcpy(&raw_header[TAR_HEADER_MTIME_OFFSET], "00000000000");
+    raw_header[TAR_HEADER_TYPE_OFFSET] = type;
+    memcpy(&raw_header[TAR_HEADER_MAGIC_OFFSET], magic, 8);
+    header_set_chksum(raw_header);
+}
+
+/* skips the comment-only extended headers that minutar_get_next_file() accepted */
+static bool skip_extended_headers(FILE *input, long header_offset, long *output_offset)
+{
+    char raw_header[TAR_BLOCKSIZE];
+
+    for (;;) {
+        RETURN_FALSE_IF(fseek(input, header_offset, SEEK_SET) != 0);
+        RETURN_FALSE_IF(fread(raw_header, 1, sizeof(raw_header), input) != TAR_BLOCKSIZE);
+        if (raw_header[TAR_HEADER_TYPE_OFFSET] != TYPEFLAG_XHD) {
+            break;
+        }
+
+        header_offset += TAR_BLOCKSIZE + block_roundup(header_size(raw_header));
+    }
+
+    *output_offset = header_offset;
+    return true;
+}
+
+static bool scan_input(FILE *input, size_t alignment, repack_list_t *list)
+{
+    filedesc_t file;
+    char *path = NULL;
+    char *linktarget = NULL;
+
+    for (;;) {
+        long header_offset = ftell(input);
+        RETURN_FALSE_IF(header_offset < 0);
+        header_offset = block_roundup(header_offset);
+
+        RETURN_FALSE_IF(!minutar_get_next_file(input, &file));
+        if (TYPEFLAG_EOA == file.type) {
+            return true;
+        } /* need cleanup after this line */
+
+        if (list->nmembers == list->members_cap) {
+            size_t new_cap = list->members_cap * 2;
+            repack_member_t *new_members = realloc(list->members, new_cap * sizeof(repack_member_t));
+            GOTO_CLEANUP_IF(NULL == new_members);
+            list->members = new_members;
+            list->members_cap = new_cap;
+        }
+
+        repack_member_t member;
+        member.data_offset = ftell(input);
+        GOTO_CLEANUP_IF(member.data_offset < 0);
+        GOTO_CLEANUP_IF(!skip_extended_headers(input, header_offset, &member.header_offset));
+        GOTO_CLEANUP_IF(fseek(input, member.data_offset, SEEK_SET) != 0);
+        GOTO_CLEANUP_IF(!minutar_skip_file(input, file));
+
+        GOTO_CLEANUP_IF(!path_normalize((NULL != file.prefix) ? file.prefix : "", file.name, &path));
+
+        /* GNU tar stores a path given twice as a hardlink to itself, there is nothing to extract */
+        if (TYPEFLAG_LNK == file.type) {
+            GOTO_CLEANUP_IF(NULL == file.linktarget);
+            GOTO_CLEANUP_IF(!path_normalize("", file.linktarget, &linktarget));
+            if (0 == strcmp(path, linktarget)) {
+                free(linktarget);
+                linktarget = NULL;
+                free(path);
+                path = NULL;
+                minutar_free_filedesc(&file);
+                continue;
+            }
+        }
+
+        member.type = file.type;
+        member.size = file.size;
+        member.ordinal = list->nmembers;
+        member.rank = member_rank(file.type, file.size, alignment);
+        member.path = path;
+        member.linktarget = linktarget;
+        member.kept = false;
+        member.contents = NULL;
+        member.relink = NULL;
+        member.leader = NULL;
+        path = NULL;
+        linktarget = NULL;
+
+        list->members[list->nmembers++] = member;
+        minutar_free_filedesc(&file);
+    }
+
+  cleanup:
+    free(path);
+    free(linktarget);
+    minutar_free_filedesc(&file);
+    return false;
+}
+
+static int compare_by_path(const void *a, const void *b)
+{
+    const repack_member_t *member_a = *(const repack_member_t *const *)a;
+    const repack_member_t *member_b = *(const repack_member_t *const *)b;
+
+    int order = strcmp(member_a->path, member_b->path);
+    if (order != 0) {
+        return order;
+    }
+    return (member_a->ordinal < member_b->ordinal) ? -1 : (member_a->ordinal > member_b->ordinal);
+}
+
+static int compare_for_extraction(const void *a, const void *b)
+{
+    const repack_member_t *member_a = *(const repack_member_t *const *)a;
+    const repack_member_t *member_b = *(const repack_member_t *const *)b;
+
+    if (member_a->rank != member_b->rank) {
+        return member_a->rank - member_b->rank;
+    }
+    /* parent directories sort before their children */
+    if (TYPEFLAG_DIR == member_a->type) {
+        return strcmp(member_a->path, member_b->path);
+    }
+    return (member_a->ordinal < member_b->ordinal) ? -1 : (member_a->ordinal > member_b->ordinal);
+}
+
+/* finds the last file node of a path before "ordinal", in members sorted with compare_by_path() */
+static repack_member_t *find_before(repack_member_t *const *by_path, size_t count, const char *path, size_t ordinal)
+{
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int order = strcmp(by_path[middle]->path, path);
+        if (order < 0 || (order == 0 && by_path[middle]->ordinal < ordinal)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return (low > 0 && 0 == strcmp(by_path[low - 1]->path, path)) ? by_path[low - 1] : NULL;
+}
+
+/* redirects the kept hardlinks whose target is replaced by a later file node */
+static bool promote_hardlinks(repack_list_t *list, repack_member_t *const *by_path, size_t alignment)
+{
+    size_t i;
+    for (i = 0; i < list->nmembers; ++i) {
+        repack_member_t *member = &list->members[i];
+        if (!member->kept || TYPEFLAG_LNK != member->type) {
+            continue;
+        }
+
+        repack_member_t *target = find_before(by_path, list->nmembers, member->linktarget, member->ordinal);
+        if (NULL == target || target->kept) {
+            continue;
+        }
+
+        /* follow the replaced hardlinks to the file node with the contents */
+        while (NULL != target && TYPEFLAG_LNK == target->type && !target->kept) {
+            target = find_before(by_path, list->nmembers, target->linktarget, target->ordinal);
+        }
+        if (NULL == target || (TYPEFLAG_REG != target->type && TYPEFLAG_CONT != target->type && !target->kept)) {
+            errno = EINVAL;
+            return false;
+        }
+
+        if (target->kept) {
+            member->relink = target;
+        } else if (NULL != target->leader) {
+            member->relink = target->leader;
+        } else {
+            RETURN_FALSE_IF(target->size > REPACK_MAX_SIZE);
+            target->leader = member;
+            member->contents = target;
+            member->rank = member_rank(target->type, target->size, alignment);
+        }
+    }
+    return true;
+}
+
+/* sorts the file nodes to write, leaving out all but the last file node of a path */
+static bool select_members(repack_list_t *list, size_t alignment, repack_member_t ***output_selected, size_t *output_count)
+{
+    repack_member_t **selected = malloc((list->nmembers + 1) * sizeof(repack_member_t *));
+    RETURN_FALSE_IF(NULL == selected);
+
+    size_t i;
+    for (i = 0; i < list->nmembers; ++i) {
+        selected[i] = &list->members[i];
+    }
+    qsort(selected, list->nmembers, sizeof(repack_member_t *), compare_by_path);
+
+    for (i = 0; i < list->nmembers; ++i) {
+        selected[i]->kept = (i + 1 == list->nmembers || 0 != strcmp(selected[i]->path, selected[i + 1]->path));
+    }
+    if (!promote_hardlinks(list, selected, alignment)) {
+        free(selected);
+        return false;
+    }
+
+    size_t count = 0;
+    for (i = 0; i < list->nmembers; ++i) {
+        if (selected[i]->kept) {
+            selected[count++] = selected[i];
+        }
+    }
+    qsort(selected, count, sizeof(repack_member_t *), compare_for_extraction);
+
+    *output_selected = selected;
+    *output_count = count;
+    return true;
+}
+
+/* writes an extended header of "len" bytes that is ignored by readers */
+static bool write_padding(FILE *output, size_t len)
+{
+    SASSERT(len >= TAR_BLOCKSIZE && len % TAR_BLOCKSIZE == 0);
+
+    char raw_header[TAR_BLOCKSIZE];
+    size_t record_len = len - TAR_BLOCKSIZE;
+    size_t i;
+
+    header_fill(raw_header, REPACK_PADDING_NAME, TYPEFLAG_XHD, record_len, "ustar\0" "00");
+    RETURN_FALSE_IF(fwrite(raw_header, 1, sizeof(raw_header), output) != TAR_BLOCKSIZE);
+    if (0 == record_len) {
+        return true;
+    }
+
+    /* one "<length> comment=<spaces>\n" record fills the blocks, the length counts its own digits */
+    size_t digits = 1;
+    size_t power = 10;
+    while (power <= record_len) {
+        ++digits;
+        power *= 10;
+    }
+    size_t value_len = record_len - digits - strlen(REPACK_PADDING_RECORD) - 1;
+
+    RETURN_FALSE_IF(fprintf(output, "%lu%s", (unsigned long)record_len, REPACK_PADDING_RECORD) < 0);
+    for (i = 0; i < value_len; ++i) {
+        RETURN_FALSE_IF(fputc(' ', output) == EOF);
+    }
+    RETURN_FALSE_IF(fputc('\n', output) == EOF);
+    return true;
+}
+
+static bool copy_range(FILE *input, long offset, size_t len, FILE *output)
+{
+    char buf[REPACK_COPY_BUFSIZE];
+
+    RETURN_FALSE_IF(fseek(input, offset, SEEK_SET) != 0);
+    while (len > 0) {
+        size_t chunk = (len < sizeof(buf)) ? len : sizeof(buf);
+        RETURN_FALSE_IF(fread(buf, 1, chunk, input) != chunk);
+        RETURN_FALSE_IF(fwrite(buf, 1, chunk, output) != chunk);
+        len -= chunk;
+    }
+    return true;
+}
+
+/* copies the headers of a hardlink with another type, size and link target,
+ * dropping its GNU long link target */
+static bool rewrite_headers(FILE *input, const repack_member_t *member, typeflag_t type, size_t size, const char *linktarget,
+                            char **output_headers, size_t *output_len)
+{
+    size_t chain_len = member->data_offset - member->header_offset;
+    size_t linktarget_len = (NULL != linktarget) ? strlen(linktarget) : 0;
+    size_t longlink_len = (linktarget_len > TAR_HEADER_LINK_WIDTH) ? TAR_BLOCKSIZE + block_roundup(linktarget_len + 1) : 0;
+    size_t len = 0;
+    size_t chain_pos = 0;
+
+    char *headers = malloc(chain_len + longlink_len);
+    RETURN_FALSE_IF(NULL == headers); /* need cleanup after this line */
+    GOTO_CLEANUP_IF(fseek(input, member->header_offset, SEEK_SET) != 0);
+
+    if (longlink_len > 0) {
+        header_fill(headers, REPACK_LONGLINK_NAME, TYPEFLAG_GNUK, linktarget_len + 1, "ustar  ");
+        memset(&headers[TAR_BLOCKSIZE], 0, longlink_len - TAR_BLOCKSIZE);
+        memcpy(&headers[TAR_BLOCKSIZE], linktarget, linktarget_len);
+        len = longlink_len;
+    }
+
+    for (;;) {
+        char *raw_header = &headers[len];
+        GOTO_CLEANUP_IF(chain_pos + TAR_BLOCKSIZE > chain_len);
+        GOTO_CLEANUP_IF(fread(raw_header, 1, TAR_BLOCKSIZE, input) != TAR_BLOCKSIZE);
+        chain_pos += TAR_BLOCKSIZE;
+
+        if (TYPEFLAG_GNUL == raw_header[TAR_HEADER_TYPE_OFFSET] || TYPEFLAG_GNUK == raw_header[TAR_HEADER_TYPE_OFFSET]) {
+            size_t data_len = block_roundup(header_size(raw_header));
+            GOTO_CLEANUP_IF(chain_pos + data_len > chain_len);
+            chain_pos += data_len;
+
+            if (TYPEFLAG_GNUK == raw_header[TAR_HEADER_TYPE_OFFSET]) {
+                GOTO_CLEANUP_IF(fseek(input, data_len, SEEK_CUR) != 0);
+            } else {
+                GOTO_CLEANUP_IF(fread(&raw_header[TAR_BLOCKSIZE], 1, data_len, input) != data_len);
+                len += TAR_BLOCKSIZE + data_len;
+            }
+            continue;
+        }
+
+        /* the header of the file node itself */
+        raw_header[TAR_HEADER_TYPE_OFFSET] = type;
+        sprintf(&raw_header[TAR_HEADER_SIZE_OFFSET], "%011lo", (unsigned long)size);
+        memset(&raw_header[TAR_HEADER_LINK_OFFSET], 0, TAR_HEADER_LINK_WIDTH);
+        if (NULL != linktarget) {
+            memcpy(&raw_header[TAR_HEADER_LINK_OFFSET], linktarget,
+                   (linktarget_len < TAR_HEADER_LINK_WIDTH) ? linktarget_len : TAR_HEADER_LINK_WIDTH);
+        }
+        header_set_chksum(raw_header);
+        len += TAR_BLOCKSIZE;
+        break;
+    }
+    GOTO_CLEANUP_IF(chain_pos != chain_len);
+
+    *output_headers = headers;
+    *output_len = len;
+    return true;
+
+  cleanup:
+    free(headers);
+    return false;
+}
+
+static bool write_member(FILE *input, const repack_member_t *member, size_t alignment, FILE *output, size_t *output_pos)
+{
+    char *headers = NULL;
+    size_t headers_len = member->data_offset - member->header_offset;
+    const repack_member_t *contents = member;
+    size_t pos = *output_pos;
+
+    if (NULL != member->contents) {
+        /* a hardlink to a replaced file node takes over its contents */
+        contents = member->contents;
+        RETURN_FALSE_IF(!rewrite_headers(input, member, TYPEFLAG_REG, contents->size, NULL, &headers, &headers_len));
+    } else if (NULL != member->relink) {
+        RETURN_FALSE_IF(!rewrite_headers(input, member, TYPEFLAG_LNK, 0, member->relink->path, &headers, &headers_len));
+    } /* need cleanup after this line */
+
+    if (contents->size > 0) {
+        size_t gap = (alignment - (pos + headers_len) % alignment) % alignment;
+        if (gap > 0) {
+            GOTO_CLEANUP_IF(!write_padding(output, gap));
+            pos += gap;
+        }
+    }
+
+    if (NULL != headers) {
+        GOTO_CLEANUP_IF(fwrite(headers, 1, headers_len, output) != headers_len);
+        GOTO_CLEANUP_IF(!copy_range(input, contents->data_offset, contents->size, output));
+    } else {
+        GOTO_CLEANUP_IF(!copy_range(input, member->header_offset, headers_len + member->size, output));
+    }
+    pos += headers_len + contents->size;
+
+    size_t tail = block_roundup(contents->size) - contents->size;
+    GOTO_CLEANUP_IF(fwrite(TAR_ZERO_BLOCK, 1, tail, output) != tail);
+    pos += tail;
+
+    free(headers);
+    *output_pos = pos;
+    return true;
+
+  cleanup:
+    free(headers);
+    return false;
+}
+
+/********************************* PUBLIC FUNCTIONS *********************************************/
+
+bool minutar_repack(FILE *input, FILE *output, size_t alignment)
+{
+    SASSERT(input != NULL);
+    SASSERT(output != NULL);
+
+    if (0 == alignment || alignment % TAR_BLOCKSIZE != 0) {
+        errno = EINVAL;
+        return false;
+    }
+
+    bool ok = false;
+    size_t i;
+    repack_member_t **selected = NULL;
+    size_t count = 0;
+    size_t output_pos = 0;
+    repack_list_t list;
+    memset(&list, 0, sizeof(list));
+
+    list.members = malloc(REPACK_INITIAL_MEMBERS * sizeof(repack_member_t));
+    RETURN_FALSE_IF(NULL == list.members); /* need cleanup after this line */
+    list.members_cap = REPACK_INITIAL_MEMBERS;
+
+    GOTO_CLEANUP_IF(!scan_input(input, alignment, &list));
+    GOTO_CLEANUP_IF(!select_members(&list, alignment, &selected, &count));
+
+    for (i = 0; i < count; ++i) {
+        GOTO_CLEANUP_IF(!write_member(input, selected[i], alignment, output, &output_pos));
+    }
+
+    /* end of archive indicator */
+    GOTO_CLEANUP_IF(fwrite(TAR_ZERO_BLOCK, 1, TAR_BLOCKSIZE, output) != TAR_BLOCKSIZE);
+    GOTO_CLEANUP_IF(fwrite(TAR_ZERO_BLOCK, 1, TAR_BLOCKSIZE, output) != TAR_BLOCKSIZE);
+    ok = true;
+
+  cleanup:
+    for (i = 0; i < list.nmembers; ++i) {
+        free(list.members[i].path);
+        free(list.members[i].linktarget);
+    }
+    free(list.members);
+    free(selected);
+    return ok;
+}
@@ -0,0 +1,39 @@
+/*!
+ *  \file repack.h
+ *  \brief Interface for rewriting tape archives with aligned file contents
+ *
+ */
+#ifndef MINUTAR_REPACK_H_INCLUDED
+#define MINUTAR_REPACK_H_INCLUDED
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*!
+ *  \fn bool minutar_repack(FILE *input, FILE *output, size_t alignment)
+ *  \brief Rewrites a tape archive so that file contents are aligned
+ *
+ *  The contents of each file node start at a multiple of
+ *  "alignment" bytes from the start of "output", which must be
+ *  a multiple of 512, e.g. 4096 for page aligned contents that
+ *  can be mapped by the reader. The gaps are filled with POSIX
+ *  extended headers that only hold a comment, so the result is a
+ *  standard tape archive. The headers are copied unchanged.
+ *
+ *  File nodes are ordered for extraction: directories first,
+ *  then files grouped by small and large size, other file nodes
+ *  and at last the hardlinks. When a path occurs more than once,
+ *  only the last one is kept. Hardlinks to an earlier one keep its
+ *  contents: the first is written as a regular file with them and
+ *  the others link to it, so extraction gives the same result.
+ *
+ *  "input" must be seekable, it is read twice from its current
+ *  read pointer. "output" is written sequentially.
+ *
+ *  Returns false on failure, caller should check errno.
+ *
+ */
+bool minutar_repack(FILE *input, FILE *output, size_t alignment);
+
+#endif /* MINUTAR_REPACK_H_INCLUDED */
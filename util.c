@@ -4,12 +4,14 @@
  *
  */
 #include <sys/stat.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 
 #include "sassert.h"
 #include "minutar.h"
+#include "util.h"
 
 
 /* TODO: Unicode support */
@@ -41,14 +43,94 @@ bool path_mkdir(const char *path, mode_t mode)
     if (end != NULL) {
         *end = '\0';
 
-        int err = mkdir(dir, mode);
-        if (err != 0)
-        {
-            free(dir);
-            return false;
+        /* create each missing element, parents first */
+        char *separator = dir;
+        while (separator != NULL) {
+            separator = strchr(separator + 1, '/');
+            if (separator != NULL) {
+                *separator = '\0';
+            }
+
+            int err = mkdir(dir, mode);
+            if (err != 0 && errno != EEXIST)
+            {
+                free(dir);
+                return false;
+            }
+
+            if (separator != NULL) {
+                *separator = '/';
+            }
         }
     }
 
     free(dir);
     return true;
 }
+
+bool path_normalize(const char *base, const char *path, char **output_path)
+{
+    SASSERT(base != NULL);
+    SASSERT(path != NULL);
+    SASSERT(output_path != NULL);
+
+    size_t base_len = strlen(base);
+    char *joined = malloc(base_len + strlen(path) + 2);
+    RETURN_FALSE_IF(NULL == joined);
+
+    if (path[0] == '/') {
+        /* absolute paths are relative to the archive root */
+        strcpy(joined, path);
+    } else {
+        memcpy(joined, base, base_len);
+        joined[base_len] = '/';
+        strcpy(&joined[base_len + 1], path);
+    }
+
+    size_t out = 0;
+    const char *element = joined;
+    while (*element != '\0') {
+        const char *end = strchr(element, '/');
+        if (NULL == end) {
+            end = element + strlen(element);
+        }
+        size_t len = end - element;
+
+        if (len == 0 || (len == 1 && element[0] == '.')) {
+            /* skip */
+        } else if (len == 2 && element[0] == '.' && element[1] == '.') {
+            while (out > 0 && joined[out - 1] != '/') {
+                out--;
+            }
+            if (out > 0) {
+                out--;
+            }
+        } else {
+            if (out > 0) {
+                joined[out++] = '/';
+            }
+            memmove(&joined[out], element, len);
+            out += len;
+        }
+
+        element = (*end == '/') ? end + 1 : end;
+    }
+    joined[out] = '\0';
+
+    *output_path = joined;
+    return true;
+}
+
+uint64_t path_hash(const char *path, size_t len)
+{
+    SASSERT(path != NULL);
+
+    /* FNV-1a */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        hash ^= (uint8_t)path[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
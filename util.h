@@ -4,11 +4,21 @@
  *
  */
 #ifndef MINUTAR_UTIL_H_INCLUDED
+#define MINUTAR_UTIL_H_INCLUDED
 
 #include <sys/stat.h>
+#include <stdint.h>
 
 #include "minutar.h"
 
+#ifdef DEBUG
+#define RETURN_FALSE_IF(x) do{ if((x)){ fprintf(stderr, "%s returned false on line %u: (%s)\r\n", __FUNCTION__, __LINE__, #x); return false; } }while(0)
+#define GOTO_CLEANUP_IF(x) do{ if((x)){ fprintf(stderr, "%s returned false on line %u: (%s)\r\n", __FUNCTION__, __LINE__, #x); goto cleanup; } }while(0)
+#else /* DEBUG */
+#define RETURN_FALSE_IF(x) do{ if((x)){ return false; } }while(0)
+#define GOTO_CLEANUP_IF(x) do{ if((x)){ goto cleanup; } }while(0)
+#endif /* DEBUG */
+
 
 /*!
  *  \fn bool canonicalize_paths(filedesc_t *file)
@@ -26,6 +36,8 @@ bool canonicalize_paths(filedesc_t *file);
  *  In the case of a trailing separator, the last element
  *  will be considered to be the empty string after it.
  *
+ *  Missing parent directories are created too.
+ *
  *  Will return true in the case of no path separator, 
  *  without attempting to create any directory.
  *  
@@ -35,4 +47,26 @@ bool canonicalize_paths(filedesc_t *file);
  */
 bool path_mkdir(const char* path, mode_t mode);
 
+/*!
+ *  \fn bool path_normalize(const char *base, const char *path, char **output_path)
+ *  \brief Joins a path to a base directory and normalizes the result
+ *
+ *  Empty and "." elements are removed and ".." elements
+ *  remove the element before them, without going above the
+ *  root. A "path" with a leading slash ignores "base". The
+ *  output has no leading or trailing slash, the root is "".
+ *
+ *  Returns false on allocation failure. If the function
+ *  returns true, the caller must free() the output path.
+ *
+ */
+bool path_normalize(const char *base, const char *path, char **output_path);
+
+/*!
+ *  \fn uint64_t path_hash(const char *path, size_t len)
+ *  \brief Hashes the first "len" characters of a path for lookup tables
+ *
+ */
+uint64_t path_hash(const char *path, size_t len);
+
 #endif /* MINUTAR_UTIL_H_INCLUDED */